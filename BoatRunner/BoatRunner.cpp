@@ -1,15 +1,12 @@
 using namespace std;
 #include "BoatRunner.hpp"
 
-#if defined(_WIN64)
-#define boatSpeed 0.3f
-#define rockSpeed 0.4f
-#define maxAcceleration 3.0f
-#else
-#define boatSpeed 0.35f
-#define rockSpeed 0.7f
-#define maxAcceleration 3.5f
-#endif
+// Speeds are in units per second: the simulation runs with a fixed timestep,
+// whatever the frame rate. They keep the feel of the old per frame values at 60 fps.
+static const float referenceFrameRate = 60.0f;
+static const float boatSpeed = 0.35f * referenceFrameRate;
+static const float rockSpeed = 0.7f * referenceFrameRate;
+static const float maxAcceleration = 3.5f * referenceFrameRate;
 
 #define ESC "\033[;"
 #define RED "31m"
@@ -22,7 +19,6 @@ using namespace std;
 static const int minRockNum = 10;
 static const int maxRockNum = 15;
 
-static const glm::mat4 I = glm::mat4(1.1f); // Identity matrix
 static const glm::vec3 origin = glm::vec3(0, 0, 0);
 static const glm::vec3 xAxis = glm::vec3(1, 0, 0); // x axis
 static const glm::vec3 yAxis = glm::vec3(0, 1, 0); // y axis
@@ -45,14 +41,17 @@ static const float rightBound = -10.0f;
 static const float forwardBound = 4.0f;
 static const float backwardBound = -2.0f;
 static const float rockGenDelta = farPlane * 2;
+// The course is generated in chunks along z, a few of them beyond the
+// horizon, and it gets denser and denser along the way
+static const float courseHorizon = farPlane + rockGenDelta;
+static const float courseChunkLength = 20.0f;
+static const int courseChunksAhead = 2;
+static const float courseRampLength = 10000.0f; // to get to the maximum density
+static const float maxCourseDensity = 2.0f;     // times the one at the start
 static const float boatWidth = 2.5f;
 static const float boatLength = 4.5f;
 static const float boatHeight = 1.5f;
 static const float rockHeight = 1.0f;
-static const float rock1Width = 2.5f;
-static const float rock2Width = 1.8f;
-static const float rock1Length = 2.5f;
-static const float rock2Length = 1.8f;
 
 static const glm::vec3 camDelta = glm::vec3(0.0f, 1.5f, 0.0f);
 static const glm::vec3 camPosDisplacement = glm::vec3(0.0f, 2.5f, -4.0f);
@@ -90,6 +89,83 @@ struct SkyBoxUniformBufferObject
     alignas(16) glm::mat4 nMat;
 };
 
+// GPU driven rocks: CullShader.comp tests every rock against the frustum and
+// the depth pyramid and picks its level of detail, CompactShader.comp turns
+// the (mesh, lod) buckets into indirect draws. Both run twice a frame: once
+// before the first render pass and once, for the rocks that were occluded,
+// before the late one. Only the object buffer is written every frame.
+static const int rockMeshCount = 2;
+static const int rockLodCount = 3; // LOD_COUNT in the compute shaders
+static const glm::vec4 rockLodDistances = glm::vec4(30.0f, 60.0f, 0.0f, 0.0f);
+static const int cullPhaseCount = 2;
+
+// Bindings of the culling DescriptorSet, in the same order as its elements
+enum CullBinding
+{
+    CULL_PARAMS = 0,
+    CULL_OBJECTS = 1,
+    CULL_MESHES = 2,
+    CULL_COUNTERS = 3, // draw count of each mesh, then instance count of each bucket
+    CULL_VISIBLE = 4,
+    CULL_DRAWS = 5,
+    CULL_DRAWN = 6, // whether phase 0 drew each rock
+    CULL_PYRAMID = 7
+};
+
+struct CullParams
+{
+    alignas(16) glm::mat4 viewProj;
+    alignas(16) glm::mat4 prevViewProj;
+    alignas(16) glm::vec4 planes[6];
+    alignas(16) glm::vec4 cameraPos;
+    alignas(16) glm::vec4 lodDistances;
+    alignas(16) glm::vec4 pyramid; // width, height, levels, previous pyramid available
+    uint32_t objectCount;
+    uint32_t capacity;
+    uint32_t meshCount;
+};
+
+struct ObjectData
+{
+    alignas(16) glm::mat4 model;
+    alignas(16) glm::uvec4 mesh;
+};
+
+struct MeshData
+{
+    alignas(16) glm::vec4 sphere;
+    alignas(16) glm::uvec4 lodFirstIndex;
+    alignas(16) glm::uvec4 lodIndexCount;
+};
+
+// State of a rock as seen by the renderer
+struct RockSnapshot
+{
+    glm::vec3 prevPos; // at the previous tick, equal to pos if the rock just spawned
+    glm::vec3 pos;
+    glm::vec3 scalingFactor;
+    float rotation;
+    uint32_t type;
+};
+
+// Everything the renderer needs from the simulation, published at the end of
+// every tick. The rocks vector only grows, up to the capacity of the field, so
+// publishing soon stops allocating.
+// Positions and time are kept for the last two ticks, to be interpolated.
+struct GameSnapshot
+{
+    uint64_t tick = 0;
+    double publishTime = 0.0; // BaseProject::steadyTime() at the end of the tick
+    float prevTime = 0.0f;
+    float time = 0.0f; // simulation time, drives the boat and ocean oscillations
+    glm::vec3 prevBoatPos = initialBoatPosition;
+    glm::vec3 boatPos = initialBoatPosition;
+    vector<RockSnapshot> rocks;
+    float score = 0.0f;
+    gameState state = PLAY;
+    InputStamp input; // last key press applied by the simulation, for the latency stats
+};
+
 struct SkyBoxData
 {
     Pipeline P;
@@ -97,236 +173,526 @@ struct SkyBoxData
     DescriptorSetSkyBox DS;
 };
 
-class Ocean
+// Scene objects (the ocean and the boat) are entities, see EntityWorld, made
+// of the components below. Their meshes, textures and descriptor sets belong
+// to BoatRunner, components only point to them. Entities are created by
+// localInit, before the simulation and render threads start, and never
+// change afterwards: the simulation thread only uses the Position, Velocity
+// and Collider components, the render thread the other ones.
+
+// Slot of the object in the TransformSystem, which keeps its translation,
+// rotation and scale, as a structure of arrays for the SIMD composition
+struct Transform
 {
-protected:
-    Model model;
-    Texture texture;
-    DescriptorSet DS;
+    uint32_t id;
+};
 
-public:
-    void init(BaseProject *br, DescriptorSetLayout DSLobj)
-    {
-        model.init(br, MODEL_PATH + "/Ocean.obj");
-        texture.init(br, TEXTURE_PATH + "/Ocean.png");
-        DS.init(br, &DSLobj, {{0, UNIFORM, sizeof(UniformBufferObject), nullptr}, {1, TEXTURE, 0, &texture}});
-    }
+// Position in the game world, at this tick and at the previous one
+struct Position
+{
+    glm::vec3 value;
+    glm::vec3 prev;
+};
 
-    void cleanup()
-    {
-        model.cleanup();
-        texture.cleanup();
-        DS.cleanup();
-    }
+// In units per second
+struct Velocity
+{
+    glm::vec3 linear;
+};
 
-    Model getModel()
-    {
-        return model;
-    }
+struct MeshRef
+{
+    Model *model;
+    uint32_t id; // mesh field of the render queue keys
+};
 
-    DescriptorSet getDS()
-    {
-        return DS;
-    }
+// Descriptor set of the object, with its uniforms and texture
+struct MaterialRef
+{
+    DescriptorSet *set;
+    uint32_t id; // material field of the render queue keys
 };
 
-class Boat
+// Objects with a collider stop the game when they hit a rock. The model
+// matrix scales the position as well, so the footprint is placed at
+// scale * position
+struct Collider
 {
-protected:
-    Model model;
-    Texture texture;
-    DescriptorSet DS;
-    glm::vec3 pos;
-    float height;
-    float width;
-    float speedFactor;
+    const Footprint *footprint;
+    float scale;
+    float height; // a jump clears the rocks when it is a third of it higher than them
+};
 
-public:
-    void init(BaseProject *br, DescriptorSetLayout DSLobj)
-    {
-        model.init(br, MODEL_PATH + "/Boat.obj");
-        texture.init(br, TEXTURE_PATH + "/Boat.bmp");
-        DS.init(br, &DSLobj, {{0, UNIFORM, sizeof(UniformBufferObject), nullptr}, {1, TEXTURE, 0, &texture}});
+// Rocks are stored as a structure of arrays: the simulation walks every rock
+// once or twice a tick, only for its x and z, so these are kept contiguous
+// and processed 4 (SSE) or 8 (AVX2) at a time. Rocks are drawn instanced, so
+// they have no DescriptorSet of their own, and y is always 0.
+enum SimdPath
+{
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2
+};
 
-        speedFactor = boatSpeed;
-        height = boatHeight;
-        width = boatWidth;
-        reset();
-        std::cout << ESC << GREEN << "Boat initialized" << RESET << std::endl;
-    }
+static const char *SimdPathName[] = {"scalar", "SSE", "AVX2"};
+
+// A boat (or any box) and a rock that may touch, found by the broadphase
+struct CollisionPair
+{
+    uint32_t box;
+    uint32_t rock;
+};
 
-    void reset()
+// Rocks of a stretch of the course of courseChunkLength, with z from its start
+struct CourseChunk
+{
+    int64_t index = 0; // the chunk starts at index * courseChunkLength from the start of the course
+    vector<float> x;
+    vector<float> z; // sorted
+    vector<float> scale;
+    vector<float> rotation;
+    vector<uint32_t> type;
+
+    void reserve(size_t count)
     {
-        pos = initialBoatPosition;
+        x.reserve(count);
+        z.reserve(count);
+        scale.reserve(count);
+        rotation.reserve(count);
+        type.reserve(count);
     }
+};
+
+// What the chunks of a course are generated from: a chunk only depends on
+// them and on its index, not on when or by which thread it is generated
+struct CourseParams
+{
+    uint64_t seed = 0;
+    float density = 0.0f; // rocks per unit of length at the start
+    uint32_t chunkCapacity = 0;
+};
 
-    void cleanup()
+static void generateChunk(const CourseParams &course, int64_t index, CourseChunk &chunk)
+{
+    chunk.index = index;
+    // the boat gets going in open water: no rocks before the horizon
+    double start = index * (double)courseChunkLength;
+    float begin = (float)std::max(0.0, farPlane - start);
+    Random random(course.seed + (uint64_t)index);
+    size_t count = 0;
+    if (begin < courseChunkLength)
     {
-        model.cleanup();
-        texture.cleanup();
-        DS.cleanup();
+        float density = course.density * std::min(1.0f + (float)(start / courseRampLength), maxCourseDensity);
+        count = std::min((size_t)(density * (courseChunkLength - begin) + random.uniform(0.0f, 1.0f)),
+                         (size_t)course.chunkCapacity);
     }
-
-    void moveLeft()
+    chunk.x.resize(count);
+    chunk.z.resize(count);
+    chunk.scale.resize(count);
+    chunk.rotation.resize(count);
+    chunk.type.resize(count);
+
+    RandomBatch batch(random);
+    batch.fill(chunk.x.data(), count, 0.0f, (float)rockMeshCount);
+    for (size_t i = 0; i < count; i++)
     {
-        // z because we need to take into account boat rotation
-        pos.x += speedFactor;
+        chunk.type[i] = std::min((uint32_t)chunk.x[i], (uint32_t)rockMeshCount - 1);
     }
-
-    void moveRight()
+    batch.fill(chunk.x.data(), count, rightBound, leftBound);
+    batch.fill(chunk.z.data(), count, begin, courseChunkLength);
+    batch.fill(chunk.scale.data(), count, minRockScalingFactor, maxRockScalingFactor);
+    batch.fill(chunk.rotation.data(), count, 0.0f, 360.0f);
+    // the rest is drawn independently of z, sorting z alone keeps it random
+    sort(chunk.z.begin(), chunk.z.end());
+}
+
+// The rocks of the course between the boat and a few chunks beyond the
+// horizon, in a ring of chunk slots: slot s holds the rocks
+// [s * chunkCapacity, s * chunkCapacity + its count). The chunks are
+// added in front of the ring and retired from its back once they are behind
+// the boat, so the rocks are always sorted by z along the ring.
+class RockField
+{
+public:
+    vector<float> x;
+    vector<float> z;
+    vector<float> scale;    // uniform scaling factor
+    vector<float> rotation; // around the y axis
+    vector<uint32_t> type;  // mesh
+    float speedFactor = rockSpeed;
+    SimdPath path = bestPath();
+    // Draws the seed of every course: a copy of the field plays the same
+    // courses as the original
+    Random random;
+    CourseParams course;
+
+    // count rocks between the boat and the horizon at the start, more later
+    void init(int count, Random generator)
     {
-        pos.x -= speedFactor;
+        random = generator;
+        course.density = count / (courseHorizon - maxDepth);
+        course.chunkCapacity = (uint32_t)ceil(course.density * maxCourseDensity * courseChunkLength) + 1;
+        chunks.resize((size_t)ceil((courseHorizon - maxDepth) / courseChunkLength) + courseChunksAhead + 2);
+        x.resize(capacity());
+        z.resize(capacity());
+        scale.resize(capacity());
+        rotation.resize(capacity());
+        type.resize(capacity());
+        resetAll();
     }
 
-    void moveForward()
+    // rocks the slots can hold, the GPU buffers are sized for it
+    size_t capacity() const
     {
-        pos.z += speedFactor * 0.33f;
+        return chunks.size() * course.chunkCapacity;
     }
 
-    void moveBackward()
+    // rocks of the live chunks
+    size_t count() const
     {
-        pos.z -= speedFactor * 0.33f;
+        return rockCount;
     }
 
-    void jump()
+    // A new course, from its start
+    void resetAll()
     {
-        pos.y += speedFactor * 0.66f;
+        course.seed = random.next();
+        travelled = 0.0;
+        head = 0;
+        liveChunks = 0;
+        rockCount = 0;
+        next = 0;
+        generateAhead();
     }
 
-    void fall()
+    // Live chunks, nearest first: the rocks of chunk c are
+    // [chunkBegin(c), chunkEnd(c))
+    size_t chunkCount() const
     {
-        pos.y -= speedFactor * 0.66f;
+        return liveChunks;
     }
 
-    Model getModel()
+    size_t chunkBegin(size_t c) const
     {
-        return model;
+        return slot(c) * course.chunkCapacity;
     }
 
-    DescriptorSet getDS()
+    size_t chunkEnd(size_t c) const
     {
-        return DS;
+        return chunkBegin(c) + chunks[slot(c)].count;
     }
 
-    float getHeight()
+    glm::vec3 getPos(size_t i) const
     {
-        return height;
+        return glm::vec3(x[i], 0.0f, z[i]);
     }
 
-    float getWidth()
+    // Moves every rock distance towards the boat, and retires the chunks
+    // that went behind depth: returns how many rocks they had
+    size_t advance(float distance, float depth)
     {
-        return width;
+        travelled += distance;
+        for (size_t c = 0; c < liveChunks; c++)
+        {
+            switch (path)
+            {
+#if HAS_AVX2_TARGET
+            case SIMD_AVX2:
+                advanceAVX2(distance, chunkBegin(c), chunkEnd(c));
+                break;
+#endif
+#if HAS_SSE
+            case SIMD_SSE:
+                advanceSSE(distance, chunkBegin(c), chunkEnd(c));
+                break;
+#endif
+            default:
+                advanceScalar(distance, chunkBegin(c), chunkEnd(c));
+                break;
+            }
+        }
+        size_t retired = 0;
+        while (liveChunks > 0 && chunkStart(chunks[head].index + 1) < depth)
+        {
+            retired += chunks[head].count;
+            rockCount -= chunks[head].count;
+            head = (head + 1) % chunks.size();
+            liveChunks--;
+        }
+        return retired;
     }
 
-    glm::vec3 getPos()
+    // The chunk to be generated next, wanted once it gets courseChunksAhead
+    // chunks from the horizon and needed once it gets to it
+    int64_t nextChunk() const
     {
-        return pos;
+        return next;
     }
 
-    void setPos(glm::vec3 newPos)
+    bool wanted(int64_t index) const
     {
-        pos = newPos;
+        return chunkStart(index) < courseHorizon + courseChunksAhead * courseChunkLength;
     }
 
-    void printPos()
+    bool needed(int64_t index) const
     {
-        printf("Boat Position: (%.1f, %.1f, %.1f)\n", pos.x, pos.y, pos.z);
+        return chunkStart(index) < courseHorizon;
     }
-};
 
-class Rock
-{
-protected:
-    DescriptorSet DS;
-    int id;
-    int type;
-    float speedFactor;
-    glm::vec3 scalingFactor;
-    glm::vec3 pos;
-    float height;
-    float width;
-    float rotationFactor;
-
-public:
-    void init(BaseProject *br, DescriptorSetLayout DSLobj, int newId, int newType, Model newModel, Texture newTexture)
+    // Adds the next chunk in front of the ring, its rocks copied into its
+    // slot at once
+    void insert(const CourseChunk &chunk)
     {
-        DS.init(br, &DSLobj, {{0, UNIFORM, sizeof(UniformBufferObject), nullptr}, {1, TEXTURE, 0, &newTexture}});
+        if (chunk.index != next || liveChunks == chunks.size())
+        {
+            throw std::runtime_error("course chunk inserted out of order!");
+        }
+        size_t s = (head + liveChunks) % chunks.size();
+        size_t base = s * course.chunkCapacity;
+        size_t n = chunk.z.size();
+        float start = chunkStart(chunk.index);
+        copy(chunk.x.begin(), chunk.x.end(), x.begin() + base);
+        copy(chunk.scale.begin(), chunk.scale.end(), scale.begin() + base);
+        copy(chunk.rotation.begin(), chunk.rotation.end(), rotation.begin() + base);
+        copy(chunk.type.begin(), chunk.type.end(), type.begin() + base);
+        for (size_t k = 0; k < n; k++)
+        {
+            z[base + k] = start + chunk.z[k];
+        }
+        chunks[s] = {chunk.index, (uint32_t)n};
+        liveChunks++;
+        rockCount += n;
+        next = chunk.index + 1;
+    }
 
-        id = newId;
-        type = newType;
-        scalingFactor = glm::vec3(glm::linearRand(minRockScalingFactor, maxRockScalingFactor));
-        speedFactor = rockSpeed;
-        reset();
-        std::cout << ESC << GREEN << "Rock " << id << " [type: " << type << "] initialized" << RESET << std::endl;
+    // Generates and inserts the wanted chunks right away
+    void generateAhead()
+    {
+        while (wanted(next))
+        {
+            generateChunk(course, next, scratch);
+            insert(scratch);
+        }
     }
 
-    void reset()
+    // Broadphase, sort and sweep along z: appends the pairs of boxes (min x,
+    // max x, min z, max z) and rocks whose z overlap. The x test is left to
+    // the narrow phase.
+    void sweep(const vector<glm::vec4> &boxes, vector<CollisionPair> &pairs) const
     {
-        // Randomly generated position according to a normal distribution
-        pos = glm::vec3(glm::linearRand(rightBound, leftBound), 0, glm::linearRand(farPlane, farPlane + rockGenDelta));
-        // same for rotation
-        rotationFactor = glm::linearRand(0.0f, 360.0f);
+        for (uint32_t b = 0; b < boxes.size(); b++)
+        {
+            for (size_t c = 0; c < liveChunks; c++)
+            {
+                size_t begin = chunkBegin(c), end = chunkEnd(c);
+                if (begin == end || z[end - 1] < boxes[b].z)
+                {
+                    continue;
+                }
+                if (z[begin] > boxes[b].w)
+                {
+                    break;
+                }
+                auto first = lower_bound(z.begin() + begin, z.begin() + end, boxes[b].z);
+                for (size_t i = first - z.begin(); i < end && z[i] <= boxes[b].w; i++)
+                {
+                    pairs.push_back({b, (uint32_t)i});
+                }
+            }
+        }
     }
 
-    void cleanup()
+    // The same pairs, testing every rock against every box, with the x test
+    // done as well: the reference for the broadphase
+    void bruteForce(const vector<glm::vec4> &boxes, vector<CollisionPair> &pairs) const
     {
-        DS.cleanup();
+        for (uint32_t b = 0; b < boxes.size(); b++)
+        {
+            const glm::vec4 &box = boxes[b];
+            for (size_t c = 0; c < liveChunks; c++)
+            {
+                for (size_t i = chunkBegin(c); i < chunkEnd(c); i++)
+                {
+                    if (x[i] >= box.x && x[i] <= box.y && z[i] >= box.z && z[i] <= box.w)
+                    {
+                        pairs.push_back({b, (uint32_t)i});
+                    }
+                }
+            }
+        }
     }
 
-    void moveForward(float accelerationFactor)
+    // First rock whose position is inside box (min x, max x, min z, max z),
+    // or -1
+    long findInBox(glm::vec4 box) const
     {
-        pos.z -= speedFactor + accelerationFactor;
+        for (size_t c = 0; c < liveChunks; c++)
+        {
+            long found;
+            switch (path)
+            {
+#if HAS_AVX2_TARGET
+            case SIMD_AVX2:
+                found = findInBoxAVX2(box, chunkBegin(c), chunkEnd(c));
+                break;
+#endif
+#if HAS_SSE
+            case SIMD_SSE:
+                found = findInBoxSSE(box, chunkBegin(c), chunkEnd(c));
+                break;
+#endif
+            default:
+                found = findInBoxScalar(box, chunkBegin(c), chunkEnd(c));
+                break;
+            }
+            if (found >= 0)
+            {
+                return found;
+            }
+        }
+        return -1;
     }
 
-    DescriptorSet getDS()
+    // The widest kernels this CPU can run
+    static SimdPath bestPath()
     {
-        return DS;
+#if HAS_AVX2_TARGET
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return SIMD_AVX2;
+        }
+#endif
+        return HAS_SSE ? SIMD_SSE : SIMD_SCALAR;
     }
 
-    float getHeight()
+    static bool pathSupported(SimdPath p)
     {
-        return height;
+        return p <= bestPath();
     }
 
-    float getWidth()
+private:
+    struct ChunkSlot
+    {
+        int64_t index;
+        uint32_t count;
+    };
+    vector<ChunkSlot> chunks;
+    size_t head = 0; // slot of the nearest chunk
+    size_t liveChunks = 0;
+    size_t rockCount = 0;
+    int64_t next = 0;
+    double travelled = 0.0; // since the start of the course, in double so that long runs keep their precision
+    CourseChunk scratch;    // for generateAhead
+
+    size_t slot(size_t c) const
     {
-        return width;
+        return (head + c) % chunks.size();
     }
 
-    glm::vec3 getPos()
+    // where chunk index starts now, relative to the boat
+    float chunkStart(int64_t index) const
     {
-        return pos;
+        return (float)(index * (double)courseChunkLength - travelled);
     }
 
-    float getRot()
+    // The scalar kernels also finish the last rocks of the SIMD ones
+    void advanceScalar(float distance, size_t i, size_t end)
     {
-        return rotationFactor;
+        for (; i < end; i++)
+        {
+            z[i] -= distance;
+        }
     }
 
-    int getId()
+    long findInBoxScalar(glm::vec4 box, size_t i, size_t end) const
     {
-        return id;
+        for (; i < end; i++)
+        {
+            if (x[i] >= box.x && x[i] <= box.y && z[i] >= box.z && z[i] <= box.w)
+            {
+                return (long)i;
+            }
+        }
+        return -1;
     }
 
-    glm::vec3 getScalingFactor()
+#if HAS_SSE
+    void advanceSSE(float distance, size_t begin, size_t end)
     {
-        return scalingFactor;
+        __m128 d = _mm_set1_ps(distance);
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4)
+        {
+            _mm_storeu_ps(&z[i], _mm_sub_ps(_mm_loadu_ps(&z[i]), d));
+        }
+        advanceScalar(distance, i, end);
     }
 
-    int getType()
+    long findInBoxSSE(glm::vec4 box, size_t begin, size_t end) const
     {
-        return type;
+        __m128 minX = _mm_set1_ps(box.x), maxX = _mm_set1_ps(box.y);
+        __m128 minZ = _mm_set1_ps(box.z), maxZ = _mm_set1_ps(box.w);
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128 xs = _mm_loadu_ps(&x[i]);
+            __m128 zs = _mm_loadu_ps(&z[i]);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(xs, minX), _mm_cmple_ps(xs, maxX)),
+                                       _mm_and_ps(_mm_cmpge_ps(zs, minZ), _mm_cmple_ps(zs, maxZ)));
+            int mask = _mm_movemask_ps(inside);
+            if (mask)
+            {
+                for (int lane = 0; lane < 4; lane++)
+                {
+                    if (mask & (1 << lane))
+                    {
+                        return (long)(i + lane);
+                    }
+                }
+            }
+        }
+        return findInBoxScalar(box, i, end);
     }
+#endif
 
-    float getSpeedFactor()
+#if HAS_AVX2_TARGET
+    __attribute__((target("avx2"))) void advanceAVX2(float distance, size_t begin, size_t end)
     {
-        return speedFactor;
+        __m256 d = _mm256_set1_ps(distance);
+        size_t i = begin;
+        for (; i + 8 <= end; i += 8)
+        {
+            _mm256_storeu_ps(&z[i], _mm256_sub_ps(_mm256_loadu_ps(&z[i]), d));
+        }
+        advanceScalar(distance, i, end);
     }
 
-    void printPos()
+    __attribute__((target("avx2"))) long findInBoxAVX2(glm::vec4 box, size_t begin, size_t end) const
     {
-        printf("Rock %d Position: (%.1f, %.1f, %.1f)\n", id, pos.x, pos.y, pos.z);
+        __m256 minX = _mm256_set1_ps(box.x), maxX = _mm256_set1_ps(box.y);
+        __m256 minZ = _mm256_set1_ps(box.z), maxZ = _mm256_set1_ps(box.w);
+        size_t i = begin;
+        for (; i + 8 <= end; i += 8)
+        {
+            __m256 xs = _mm256_loadu_ps(&x[i]);
+            __m256 zs = _mm256_loadu_ps(&z[i]);
+            __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(xs, minX, _CMP_GE_OQ), _mm256_cmp_ps(xs, maxX, _CMP_LE_OQ)),
+                                          _mm256_and_ps(_mm256_cmp_ps(zs, minZ, _CMP_GE_OQ), _mm256_cmp_ps(zs, maxZ, _CMP_LE_OQ)));
+            int mask = _mm256_movemask_ps(inside);
+            if (mask)
+            {
+                for (int lane = 0; lane < 8; lane++)
+                {
+                    if (mask & (1 << lane))
+                    {
+                        return (long)(i + lane);
+                    }
+                }
+            }
+        }
+        return findInBoxScalar(box, i, end);
     }
+#endif
 };
 
 class BoatRunner : public BaseProject
@@ -345,24 +711,111 @@ protected:
 
     DescriptorSet DS_global;
     SkyBoxData skybox;
-    Ocean ocean;
-    Boat boat;
-
-    int rockCount;
-    Model rockModels[2];
-    Texture rockTextures[2];
-    vector<Rock> rocks;
 
-    glm::vec3 cameraPosition;
-    /*	debugging purposes
-     *	glm::vec3 oldBoatPos = initialBoatPosition; */
+    // Scene objects, drawn with P1 (see createObject). The components point
+    // to the elements of the deques, which never move
+    EntityWorld world;
+    deque<Model> objectModels;
+    deque<Texture> objectTextures;
+    deque<DescriptorSet> objectSets;
+    Entity ocean;
+    Entity boat;
+
+    // Random streams of the game, see randomStream()
+    enum RandomStreamId
+    {
+        STREAM_SETUP = 0,
+        STREAM_ROCKS = 1
+    };
 
-    // game logic related variables
+    int rockCount;
+    Model rockModels[rockMeshCount];
+    Texture rockTextures[rockMeshCount];
+    RockField rocks;
+    uint32_t rockCapacity = 0; // of the field, the GPU buffers are sized for it
+    // The next chunk of the course, generated by a job while the simulation
+    // goes on (see streamCourse)
+    struct CourseJob
+    {
+        Job job;
+        JobCounter counter;
+        CourseParams course;
+        int64_t index = 0;
+        CourseChunk chunk;
+        bool running = false;
+    };
+    CourseJob courseJob;
+
+    // GPU culling and indirect drawing of the rocks
+    DescriptorSetLayout DSLcull;
+    DescriptorSetLayout DSLtexture;
+    DescriptorSet DS_cull;
+    DescriptorSet DS_rockTextures[rockMeshCount];
+    ComputePipeline cullPipeline;
+    ComputePipeline compactPipeline;
+    Pipeline P_rocks;
+
+    glm::vec3 cameraPosition = initialCameraPosition;
+
+    // Matrices of the current frame, used to cull and sort the render queue
+    glm::mat4 viewMatrix;
+    glm::mat4 viewProjMatrix;
+    glm::mat4 prevViewProjMatrix; // the depth pyramid was built with it
+    // Model matrices of the scene, see TransformSystem: the objects come
+    // first, then the rocks
+    TransformSystem transforms;
+    uint32_t firstRockTransform = 0;
+    vector<float> rockAngles; // the rotations are only turned into quaternions when they change
+    vector<uint32_t> frameRockCounts; // rocks culled by the last frame recorded with each slot
+    uint8_t skyboxStale = 0xff; // frames whose skybox uniforms are out of date
+    static const size_t transformGroupsPerJob = 256; // of 4 transforms
+    // The camera and object uniforms stay mapped, so that lateLatch can
+    // rewrite them right before the frame is submitted
+    vector<void *> globalUniforms;
+    vector<void *> objectUniforms; // [transform id * framesInFlight + frame]
+    // Objects to be culled, with what they are drawn with
+    struct ObjectDraw
+    {
+        Model *model;
+        VkDescriptorSet set;
+        uint32_t mesh;
+        uint32_t material;
+    };
+    vector<ObjectDraw> objectDraws;
+    vector<glm::vec4> boundingSpheres;
+    vector<uint32_t> visibleObjects;
+
+    // game logic related variables, owned by the simulation thread
     float score;
     float highScore;
     float accFactor;
     gameState state;
     gameDifficulty difficulty;
+    uint64_t tick = 0;
+    float simulationTime = 0.0f;
+    bool simulationStarted = false;
+    // rock positions at the start of the tick, to be interpolated from
+    vector<float> prevRockX;
+    vector<float> prevRockZ;
+    // collision boxes of the colliders, with their footprints placed in the
+    // world and their motion along the tick
+    vector<glm::vec4> colliderAreas;
+    vector<WorldFootprint> colliderShapes;
+    vector<glm::vec2> colliderMotions;
+    vector<CollisionPair> collisionPairs;
+    // collision footprints of the rock meshes, copied from the models when
+    // they are loaded, and the one placed in the world for the narrow phase
+    Footprint rockFootprints[rockMeshCount];
+    float rockReach = 0.0f; // of the largest rock mesh
+    float rockStep = 0.0f;  // distance the rocks moved in the last tick
+    WorldFootprint rockShape;
+    int stormRockCount = 0;
+    bool teleported = false; // set by initGame: nothing to interpolate from
+    bool invulnerable = false; // rocks are hit but do not end the game
+    gameState publishedState = PLAY;
+
+    // Handed from the simulation thread to the render thread
+    TripleBuffer<GameSnapshot> snapshots;
 
     // application parameters:
     // Window size, titile and initial background
@@ -378,12 +831,22 @@ protected:
          *  according to a normal distribution, the number
          *  of rocks determines the difficulty of the game
          */
-        rockCount = rand() % (maxRockNum - minRockNum + 1) + minRockNum;
+        Random setup = randomStream(STREAM_SETUP);
+        rockCount = setup.below(maxRockNum - minRockNum + 1) + minRockNum;
+        if (stormRockCount > 0)
+        {
+            rockCount = stormRockCount;
+        }
 
         // Descriptor pool sizes
-        uniformBlocksInPool = rockCount + 4; // ocean, skybox, boat, rocks
-        texturesInPool = rockCount + 3;
-        setsInPool = rockCount + 4;
+        uniformBlocksInPool = 5; // ocean, skybox, boat, camera, culling parameters
+        texturesInPool = 4 + rockMeshCount; // ocean, skybox, boat, depth pyramid, rocks
+        storageBlocksInPool = 6;             // culling buffers
+        setsInPool = 5 + rockMeshCount;
+
+        // Command buffer slices, recorded in parallel every frame:
+        // each one replays a part of the sorted render queue
+        commandBufferSlices = 3;
     }
 
     // Here you load and setup all your Vulkan objects
@@ -408,6 +871,22 @@ protected:
         // be used in this pipeline. The first element will be set 0, and so on..
         P1.init(this, VERTEX_SHADER, FRAGMENT_SHADER, {&DSLglobal, &DSLobj}, VK_COMPARE_OP_LESS_OR_EQUAL);
 
+        // Rocks: the culling set is shared by the compute shaders, which fill it,
+        // and by the instanced rock pipeline, which reads the visible objects
+        DSLcull.init(this, {{CULL_PARAMS, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+                            {CULL_OBJECTS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_VERTEX_BIT},
+                            {CULL_MESHES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+                            {CULL_COUNTERS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+                            {CULL_VISIBLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_VERTEX_BIT},
+                            {CULL_DRAWS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+                            {CULL_DRAWN, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+                            {CULL_PYRAMID, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT}});
+        DSLtexture.init(this, {{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}});
+        P_rocks.init(this, "shaders/RockVert.spv", FRAGMENT_SHADER, {&DSLglobal, &DSLtexture, &DSLcull}, VK_COMPARE_OP_LESS_OR_EQUAL);
+        // the push constant is the culling phase
+        cullPipeline.init(this, "shaders/CullComp.spv", {&DSLcull}, sizeof(uint32_t));
+        compactPipeline.init(this, "shaders/CompactComp.spv", {&DSLcull}, sizeof(uint32_t));
+
         // Models, textures and Descriptors (values assigned to the uniforms)
 
         // Skybox DescriptorSetLayout, Pipeline and DescriptorSet
@@ -416,30 +895,83 @@ protected:
         skybox.P.init(this, "shaders/SkyBoxVert.spv", "shaders/SkyBoxFrag.spv", {&skybox.DSL}, VK_COMPARE_OP_LESS_OR_EQUAL);
         skybox.DS.init(this, &skybox.DSL, {{0, UNIFORM, sizeof(SkyBoxUniformBufferObject), nullptr}, {1, TEXTURE, 0, &(SkyBox.TD)}});
 
-        // Ocean Model, Texture and DescriptorSet
-        ocean.init(this, DSLobj);
-        // Same for boat
-        boat.init(this, DSLobj);
+        // Ocean and boat, each with its Model, Texture and DescriptorSet
+        ocean = createObject("/Ocean.obj", "/Ocean.png");
+        boat = createObject("/Boat.obj", "/Boat.bmp");
+        // the boat is also moved by the player, and it can hit the rocks
+        world.add(boat, Position{initialBoatPosition, initialBoatPosition});
+        world.add(boat, Velocity{glm::vec3(0.0f)});
+        world.add(boat, Collider{&world.get<MeshRef>(boat).model->footprint, boatScalingFactor.x, boatHeight});
+        std::cout << ESC << GREEN << "Boat initialized" << RESET << std::endl;
 
-        // As for rocks we just initialize the models and textures
-        rockModels[0].init(this, MODEL_PATH + ROCK_MODELS_PATH[0]);
-        rockModels[1].init(this, MODEL_PATH + ROCK_MODELS_PATH[1]);
-        rockTextures[0].init(this, TEXTURE_PATH + ROCK_TEXTURES_PATH[0]);
-        rockTextures[1].init(this, TEXTURE_PATH + ROCK_TEXTURES_PATH[1]);
+        // As for rocks we initialize the models, with their levels of detail,
+        // and the textures, each one with its own DescriptorSet.
+        // The meshes are parsed and simplified in parallel, by the jobs
+        jobs.parallelFor(rockMeshCount, 1, [&](size_t begin, size_t end)
+                         {
+                             for (size_t m = begin; m < end; m++)
+                             {
+                                 rockModels[m].load(MODEL_PATH + ROCK_MODELS_PATH[m], rockLodCount);
+                             } });
+        for (int m = 0; m < rockMeshCount; m++)
+        {
+            rockModels[m].upload(this);
+            rockTextures[m].init(this, TEXTURE_PATH + ROCK_TEXTURES_PATH[m]);
+            DS_rockTextures[m].init(this, &DSLtexture, {{1, TEXTURE, 0, &rockTextures[m]}});
+            rockFootprints[m] = rockModels[m].footprint;
+            rockReach = std::max(rockReach, rockFootprints[m].reach());
+        }
 
-        // and then a DescriptorSet for each rock we want to render
-        int rockSelection;
-        for (int i = 0; i < rockCount; i++)
+        rocks.init(rockCount, randomStream(STREAM_ROCKS));
+        rockCapacity = (uint32_t)rocks.capacity();
+        // the snapshots, the chunk being generated and the collision pairs
+        // are sized for the densest stretch of the course, so that the
+        // simulation does not allocate when it gets there (a collider is
+        // shorter than a chunk, it meets the rocks of two chunks at most)
+        for (GameSnapshot &slot : snapshots.slots)
         {
-            rockSelection = rand() % 2;
-            Rock rock;
-            rock.init(this, DSLobj, i, rockSelection, rockModels[rockSelection], rockTextures[rockSelection]);
-            rocks.push_back(rock);
+            slot.rocks.reserve(rockCapacity);
         }
+        courseJob.chunk.reserve(rocks.course.chunkCapacity);
+        collisionPairs.reserve(2 * rocks.course.chunkCapacity);
+        std::cout << ESC << GREEN << "Course initialized [" << rocks.count() << " rocks in "
+                  << rocks.chunkCount() << " chunks]" << RESET << std::endl;
+        std::cout << "rock kernels: " << SimdPathName[rocks.path] << std::endl;
+
+        // each (mesh, lod) bucket of each phase can hold every rock
+        int buckets = cullPhaseCount * rockMeshCount * rockLodCount;
+        DS_cull.init(this, &DSLcull, {{CULL_PARAMS, UNIFORM, sizeof(CullParams), nullptr},
+                                      {CULL_OBJECTS, STORAGE, (int)(rockCapacity * sizeof(ObjectData)), nullptr},
+                                      {CULL_MESHES, STORAGE, (int)(rockMeshCount * sizeof(MeshData)), nullptr},
+                                      {CULL_COUNTERS, STORAGE, (int)((cullPhaseCount * rockMeshCount + buckets) * sizeof(uint32_t)), nullptr},
+                                      {CULL_VISIBLE, STORAGE, (int)(buckets * rockCapacity * sizeof(uint32_t)), nullptr},
+                                      {CULL_DRAWS, STORAGE, (int)(buckets * sizeof(VkDrawIndexedIndirectCommand)), nullptr},
+                                      {CULL_DRAWN, STORAGE, (int)(rockCapacity * sizeof(uint32_t)), nullptr},
+                                      {CULL_PYRAMID, TEXTURE, 0, &depthPyramid.texture}});
+        uploadRockMeshes();
 
         // Global DescriptorSet, for camera
         DS_global.init(this, &DSLglobal, {{0, UNIFORM, sizeof(globalUniformBufferObject), nullptr}});
 
+        firstRockTransform = (uint32_t)objectSets.size();
+        transforms.init(firstRockTransform + rockCapacity, framesInFlight);
+        // making the ocean shorter in height so that it doesn't cover the boat
+        transforms.setScale(world.get<Transform>(ocean).id, oceanScalingFactor * glm::vec3(1, 0.5f, 1));
+        transforms.setScale(world.get<Transform>(boat).id, boatScalingFactor);
+        rockAngles.assign(rockCapacity, -1.0f);
+        frameRockCounts.assign(framesInFlight, 0);
+
+        globalUniforms.resize(framesInFlight);
+        objectUniforms.resize(objectSets.size() * framesInFlight);
+        for (int i = 0; i < framesInFlight; i++)
+        {
+            vkMapMemory(device, DS_global.uniformBuffersMemory[0][i], 0, sizeof(globalUniformBufferObject), 0, &globalUniforms[i]);
+            for (size_t o = 0; o < objectSets.size(); o++)
+            {
+                vkMapMemory(device, objectSets[o].uniformBuffersMemory[0][i], 0, sizeof(UniformBufferObject), 0, &objectUniforms[o * framesInFlight + i]);
+            }
+        }
+
         // game logic related code
         highScore = (float)readScore("highscore.dat"); // reading old highscore from file
         // detecting game difficulty basing on the casually generated number of rocks
@@ -460,6 +992,32 @@ protected:
                   << "Highest score: " << highScore << " / Difficulty: " << difficultyString << "]:" << std::endl;
     }
 
+    // A scene object: an entity with a Transform, a MeshRef and a
+    // MaterialRef, drawn by P1 with the model and texture files given. The
+    // transform id is also the index of the object in objectModels,
+    // objectTextures and objectSets. Objects are culled, drawn and uploaded
+    // whatever they are, a new kind only has to be moved
+    Entity createObject(const string &modelFile, const string &textureFile)
+    {
+        uint32_t id = (uint32_t)objectSets.size();
+        objectModels.emplace_back();
+        objectModels.back().init(this, MODEL_PATH + modelFile);
+        objectTextures.emplace_back();
+        objectTextures.back().init(this, TEXTURE_PATH + textureFile);
+        objectSets.emplace_back();
+        objectSets.back().init(this, &DSLobj, {{0, UNIFORM, sizeof(UniformBufferObject), nullptr}, {1, TEXTURE, 0, &objectTextures.back()}});
+        return world.create(Transform{id}, MeshRef{&objectModels.back(), id}, MaterialRef{&objectSets.back(), MATERIAL_OBJECT + id});
+    }
+
+    // The depth pyramid is rebuilt with the swap chain, at its new size:
+    // the culling sets have to sample the new one
+    void onSwapChainRecreated()
+    {
+        DS_cull.writeTexture(CULL_PYRAMID, &depthPyramid.texture);
+        // the skybox has the aspect ratio of the window in its matrix
+        skyboxStale = transforms.allFrames;
+    }
+
     // Here you destroy all the objects you created!
     void localCleanup()
     {
@@ -471,20 +1029,37 @@ protected:
         skybox.P.cleanup();
         skybox.DSL.cleanup();
 
-        ocean.cleanup();
-        boat.cleanup();
-
-        rockModels[0].cleanup();
-        rockModels[1].cleanup();
+        for (int i = 0; i < framesInFlight; i++)
+        {
+            vkUnmapMemory(device, DS_global.uniformBuffersMemory[0][i]);
+            for (size_t o = 0; o < objectSets.size(); o++)
+            {
+                vkUnmapMemory(device, objectSets[o].uniformBuffersMemory[0][i]);
+            }
+        }
 
-        rockTextures[0].cleanup();
-        rockTextures[1].cleanup();
+        world.clear();
+        for (size_t o = 0; o < objectSets.size(); o++)
+        {
+            objectModels[o].cleanup();
+            objectTextures[o].cleanup();
+            objectSets[o].cleanup();
+        }
 
-        for (auto &r : rocks)
+        for (int m = 0; m < rockMeshCount; m++)
         {
-            r.cleanup();
+            rockModels[m].cleanup();
+            rockTextures[m].cleanup();
+            DS_rockTextures[m].cleanup();
         }
 
+        DS_cull.cleanup();
+        cullPipeline.cleanup();
+        compactPipeline.cleanup();
+        P_rocks.cleanup();
+        DSLcull.cleanup();
+        DSLtexture.cleanup();
+
         DS_global.cleanup();
 
         P1.cleanup();
@@ -492,136 +1067,257 @@ protected:
         DSLobj.cleanup();
     }
 
-    // Here it is the creation of the command buffer:
-    // You send to the GPU all the objects you want to draw,
-    // with their buffers and textures
-    void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage)
+    // Ids used to build the render queue sort keys: draws are grouped by
+    // pipeline first, then by material (descriptor set + texture) and mesh
+    enum DrawPipelineId
     {
-        // Skybox
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, skybox.P.graphicsPipeline);
-
-        VkBuffer SBVertexBuffers[] = {SkyBox.MD.vertexBuffer};
-        VkDeviceSize SBOffsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, SBVertexBuffers, SBOffsets);
-        vkCmdBindIndexBuffer(commandBuffer, SkyBox.MD.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                skybox.P.pipelineLayout, 0, 1, &skybox.DS.descriptorSets[currentImage],
-                                0, nullptr);
-
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(SkyBox.MD.indices.size()), 1, 0, 0, 0);
-
-        // Global Pipeline
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, P1.graphicsPipeline);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-                                0, nullptr);
-
-        // Ocean
-        VkBuffer oceanVertexBuffers[] = {ocean.getModel().vertexBuffer};
-        VkDeviceSize oceanOffsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, oceanVertexBuffers, oceanOffsets);
-
-        vkCmdBindIndexBuffer(commandBuffer, ocean.getModel().indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+        PIPELINE_GLOBAL = 0,
+        PIPELINE_ROCKS = 1,
+        PIPELINE_SKYBOX = 2
+    };
+    enum DrawMaterialId
+    {
+        MATERIAL_ROCK = 0,              // + rock type
+        MATERIAL_OBJECT = rockMeshCount // + object id
+    };
+
+    // Here we submit to the render queue all the objects we want to draw,
+    // with their buffers and descriptor sets. The engine sorts the queue
+    // and splits it among the recording jobs, so the order of submission
+    // does not matter: the skybox goes in the background pass, which is
+    // always drawn last, so that the depth test discards most of its fragments
+    void populateRenderQueue(RenderQueue &queue, uint32_t currentFrame)
+    {
+        // Frustum culling of the scene objects, rocks are culled on the GPU
+        // by recordComputeCommands
+        boundingSpheres.clear();
+        objectDraws.clear();
+        world.each<Transform, MeshRef, MaterialRef>([&](size_t count, Entity *, Transform *transform, MeshRef *mesh, MaterialRef *material)
+                                                    {
+                                                        for (size_t i = 0; i < count; i++)
+                                                        {
+                                                            boundingSpheres.push_back(mesh[i].model->worldBoundingSphere(transforms.matrices[transform[i].id]));
+                                                            objectDraws.push_back({mesh[i].model, material[i].set->descriptorSets[currentFrame], mesh[i].id, material[i].id});
+                                                        } });
+        cullObjects(viewProjMatrix, boundingSpheres, visibleObjects);
+        countVisibleRocks(currentFrame);
+
+        DrawCommand draw{};
+        draw.pipeline = &P1;
+        draw.setCount = 2;
+        draw.sets[0] = DS_global.descriptorSets[currentFrame];
+
+        for (uint32_t object : visibleObjects)
+        {
+            const ObjectDraw &objectDraw = objectDraws[object];
+            setDrawModel(draw, *objectDraw.model);
+            draw.sets[1] = objectDraw.set;
+            draw.key = RenderQueue::makeKey(PASS_OPAQUE, PIPELINE_GLOBAL, objectDraw.material, objectDraw.mesh,
+                                            depthKey(glm::vec4(glm::vec3(boundingSpheres[object]), 1.0f)));
+            queue.submit(draw);
+        }
 
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 1, 1, &ocean.getDS().descriptorSets[currentImage],
-                                0, nullptr);
+        // Rocks, one indirect draw per mesh and culling phase, written by
+        // CompactShader.comp: the commands of mesh m in phase p start at
+        // (p * rockMeshCount + m) * rockLodCount, their count is at
+        // p * (rockMeshCount + buckets) + m. Phase 1 draws go in the late pass
+        draw.pipeline = &P_rocks;
+        draw.setCount = 3;
+        draw.sets[2] = DS_cull.descriptorSets[currentFrame];
+        draw.indirectBuffer = DS_cull.uniformBuffers[CULL_DRAWS][currentFrame];
+        draw.countBuffer = DS_cull.uniformBuffers[CULL_COUNTERS][currentFrame];
+        draw.maxDrawCount = rockLodCount;
+        for (int phase = 0; phase < cullPhaseCount; phase++)
+        {
+            for (int m = 0; m < rockMeshCount; m++)
+            {
+                setDrawModel(draw, rockModels[m]);
+                draw.sets[1] = DS_rockTextures[m].descriptorSets[currentFrame];
+                draw.indirectOffset = (phase * rockMeshCount + m) * rockLodCount * sizeof(VkDrawIndexedIndirectCommand);
+                draw.countOffset = (phase * rockMeshCount * (1 + rockLodCount) + m) * sizeof(uint32_t);
+                draw.key = RenderQueue::makeKey(phase == 0 ? PASS_OPAQUE : PASS_LATE, PIPELINE_ROCKS,
+                                                MATERIAL_ROCK + m, MATERIAL_ROCK + m, 0);
+                queue.submit(draw);
+            }
+        }
 
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(ocean.getModel().indices.size()), 1, 0, 0, 0);
+        // Skybox, never culled
+        draw = {};
+        draw.pipeline = &skybox.P;
+        draw.setCount = 1;
+        draw.sets[0] = skybox.DS.descriptorSets[currentFrame];
+        draw.vertexBuffer = SkyBox.MD.vertexBuffer;
+        draw.indexBuffer = SkyBox.MD.indexBuffer;
+        draw.indexCount = static_cast<uint32_t>(SkyBox.MD.indices.size());
+        draw.key = RenderQueue::makeKey(PASS_BACKGROUND, PIPELINE_SKYBOX, 0, 0, 0);
+        queue.submit(draw);
+    }
 
-        // Boat
-        VkBuffer boatVertexBuffers[] = {boat.getModel().vertexBuffer};
-        // property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-        VkDeviceSize boatOffsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, boatVertexBuffers, boatOffsets);
+    // The counters of this frame slot still hold the result of the last frame
+    // recorded with it, which is complete since its fence has been waited:
+    // the statistics of the rocks lag framesInFlight frames behind. Counters
+    // and draws are then cleared here, from the CPU, rather than with
+    // vkCmdFillBuffer: a transfer command in the frame would wait for the
+    // swap chain image along with the final blit.
+    void countVisibleRocks(uint32_t currentFrame)
+    {
+        void *data;
+        vkMapMemory(device, DS_cull.uniformBuffersMemory[CULL_COUNTERS][currentFrame], 0, VK_WHOLE_SIZE, 0, &data);
+        uint32_t *counters = static_cast<uint32_t *>(data);
+        uint32_t visible = 0;
+        for (int phase = 0; phase < cullPhaseCount; phase++)
+        {
+            uint32_t *phaseCounters = counters + phase * rockMeshCount * (1 + rockLodCount);
+            for (int b = 0; b < rockMeshCount * rockLodCount; b++)
+            {
+                visible += phaseCounters[rockMeshCount + b];
+            }
+        }
+        memset(data, 0, cullPhaseCount * rockMeshCount * (1 + rockLodCount) * sizeof(uint32_t));
+        vkUnmapMemory(device, DS_cull.uniformBuffersMemory[CULL_COUNTERS][currentFrame]);
+
+        // zero commands draw nothing, in case drawIndirectCount is not available
+        vkMapMemory(device, DS_cull.uniformBuffersMemory[CULL_DRAWS][currentFrame], 0, VK_WHOLE_SIZE, 0, &data);
+        memset(data, 0, cullPhaseCount * rockMeshCount * rockLodCount * sizeof(VkDrawIndexedIndirectCommand));
+        vkUnmapMemory(device, DS_cull.uniformBuffersMemory[CULL_DRAWS][currentFrame]);
+
+        visible = std::min(visible, frameRockCounts[currentFrame]);
+        uint32_t culled = frameRockCounts[currentFrame] - visible;
+        stats.lastVisible += visible;
+        stats.lastCulled += culled;
+        stats.totalVisible += visible;
+        stats.totalCulled += culled;
+    }
 
-        vkCmdBindIndexBuffer(commandBuffer, boat.getModel().indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+    // Rock culling on the GPU: with the counters cleared by countVisibleRocks,
+    // phase 0 culls against the depth pyramid of the previous frame
+    void recordComputeCommands(VkCommandBuffer commandBuffer, uint32_t currentFrame)
+    {
+        recordCullPhase(commandBuffer, currentFrame, 0);
+    }
 
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 1, 1, &boat.getDS().descriptorSets[currentImage],
-                                0, nullptr);
+    // Phase 1 tests the rocks phase 0 did not draw against the pyramid built
+    // from this frame's depth, the ones found visible go in the late pass
+    void recordLateComputeCommands(VkCommandBuffer commandBuffer, uint32_t currentFrame)
+    {
+        recordCullPhase(commandBuffer, currentFrame, 1);
+    }
 
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(boat.getModel().indices.size()), 1, 0, 0, 0);
+    // CullShader.comp fills the (mesh, lod) buckets of the phase and
+    // CompactShader.comp writes its indirect draws
+    void recordCullPhase(VkCommandBuffer commandBuffer, uint32_t currentFrame, uint32_t phase)
+    {
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline.pipelineLayout,
+                                0, 1, &DS_cull.descriptorSets[currentFrame], 0, nullptr);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline.computePipeline);
+        vkCmdPushConstants(commandBuffer, cullPipeline.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                           0, sizeof(phase), &phase);
+        // the shader skips the slots past the rocks of the snapshot
+        vkCmdDispatch(commandBuffer, (rockCapacity + 63) / 64, 1, 1);
+        computeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+        // same layout, so the set and the push constant stay bound
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, compactPipeline.computePipeline);
+        vkCmdDispatch(commandBuffer, 1, 1, 1);
+        computeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                       VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+    }
 
-        // Rocks
+    void computeBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+                        VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+    {
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstAccessMask = dstAccess;
+        vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
 
-        // type 1
-        VkBuffer rockType1VertexBuffers[] = {rockModels[0].vertexBuffer};
-        VkDeviceSize rockType1offsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, rockType1VertexBuffers, rockType1offsets);
-        vkCmdBindIndexBuffer(commandBuffer, rockModels[0].indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-        for (auto &r : rocks)
+    // The mesh table never changes: bounds and LOD ranges are written once,
+    // for every frame in flight, together with empty counters
+    void uploadRockMeshes()
+    {
+        MeshData meshes[rockMeshCount]{};
+        for (int m = 0; m < rockMeshCount; m++)
         {
-            if (r.getType() != 0)
+            meshes[m].sphere = glm::vec4(rockModels[m].boundCenter, rockModels[m].boundRadius);
+            for (int l = 0; l < rockLodCount; l++)
             {
-                continue;
-            }
-            vkCmdBindDescriptorSets(commandBuffer,
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    P1.pipelineLayout, 1, 1, &r.getDS().descriptorSets[currentImage],
-                                    0, nullptr);
-            vkCmdDrawIndexed(commandBuffer,
-                             static_cast<uint32_t>(rockModels[0].indices.size()), 1, 0, 0, 0);
-        }
-
-        // type 2
-        VkBuffer rockType2VertexBuffers[] = {rockModels[1].vertexBuffer};
-        VkDeviceSize rockType2offsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, rockType2VertexBuffers, rockType2offsets);
-        vkCmdBindIndexBuffer(commandBuffer, rockModels[1].indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-        for (auto &r : rocks)
-        {
-            if (r.getType() != 1)
-            {
-                continue;
+                meshes[m].lodFirstIndex[l] = rockModels[m].lods[l].firstIndex;
+                meshes[m].lodIndexCount[l] = rockModels[m].lods[l].indexCount;
             }
-            vkCmdBindDescriptorSets(commandBuffer,
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    P1.pipelineLayout, 1, 1, &r.getDS().descriptorSets[currentImage],
-                                    0, nullptr);
-            vkCmdDrawIndexed(commandBuffer,
-                             static_cast<uint32_t>(rockModels[1].indices.size()), 1, 0, 0, 0);
+        }
+
+        void *data;
+        for (int i = 0; i < framesInFlight; i++)
+        {
+            vkMapMemory(device, DS_cull.uniformBuffersMemory[CULL_MESHES][i], 0, sizeof(meshes), 0, &data);
+            memcpy(data, meshes, sizeof(meshes));
+            vkUnmapMemory(device, DS_cull.uniformBuffersMemory[CULL_MESHES][i]);
+
+            vkMapMemory(device, DS_cull.uniformBuffersMemory[CULL_COUNTERS][i], 0, VK_WHOLE_SIZE, 0, &data);
+            memset(data, 0, cullPhaseCount * rockMeshCount * (1 + rockLodCount) * sizeof(uint32_t));
+            vkUnmapMemory(device, DS_cull.uniformBuffersMemory[CULL_COUNTERS][i]);
         }
     }
 
-    void updateUniformBuffer(uint32_t currentImage)
+    void setDrawModel(DrawCommand &draw, const Model &model)
     {
-        static auto startTime = std::chrono::high_resolution_clock::now();
-        static float lastTime = 0.0f;
+        draw.vertexBuffer = model.vertexBuffer;
+        draw.indexBuffer = model.indexBuffer;
+        draw.indexCount = model.lods[0].indexCount;
+    }
 
-        if (lastTime == 0.0f)
+    // Quantized view space distance of a world position, opaque objects
+    // are drawn front to back to make the most of early depth testing
+    uint32_t depthKey(const glm::vec4 &worldPos)
+    {
+        float viewDepth = -(viewMatrix * worldPos).z;
+        return RenderQueue::quantizeDepth(viewDepth, nearPlane, farPlane);
+    }
+
+    // Simulation thread: the game logic, one tick of dt seconds at a time, so
+    // the game plays the same at any frame rate. The renderer only sees what
+    // is published in the snapshots
+    void simulate(float dt)
+    {
+        if (!simulationStarted)
         {
             printMenu();
             initGame();
+            simulationStarted = true;
         }
 
-        auto currentTime = std::chrono::high_resolution_clock::now();
-        float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
-        float deltaT = time - lastTime;
-        lastTime = time;
+        float prevTime = simulationTime;
+        world.each<Position>([](size_t count, Entity *, Position *position)
+                             {
+                                 for (size_t i = 0; i < count; i++)
+                                 {
+                                     position[i].prev = position[i].value;
+                                 } });
+        prevRockX = rocks.x;
+        prevRockZ = rocks.z;
+
+        simulationTime += dt;
+        float time = simulationTime;
 
         // progressive acceleration with max threeshold
+        // (the old per frame increment, in units per second squared)
         if (accFactor >= maxAcceleration)
         {
             accFactor = maxAcceleration;
         }
         else
         {
-            accFactor += log10(log10(lastTime / 10000 + 10));
+            accFactor += log10(log10(time / 10000 + 10)) * referenceFrameRate * referenceFrameRate * dt;
         }
 
-        updatePosition(accFactor, time);
+        updatePosition(accFactor, time, dt);
         if (state == PLAY)
         {
-            score += deltaT;
+            score += dt;
             // Updating score in console while running
             std::cout << ESC << PURPLE << "score: " << score << RESET << '\r' << std::flush;
 
@@ -630,76 +1326,259 @@ protected:
             detectCollisions();
         }
 
-        SkyBoxUniformBufferObject subo{};
-        globalUniformBufferObject gubo{};
-        UniformBufferObject ubo{};
+        publishSnapshot(prevTime, time);
+    }
 
-        void *data;
+    // Once the game is over nothing moves but the sea: the engine can draw
+    // at its idle frame rate
+    bool isIdle()
+    {
+        return snapshots.read().state == GAME_OVER;
+    }
+
+    void publishSnapshot(float prevTime, float time)
+    {
+        GameSnapshot &snapshot = snapshots.writeSlot();
+        snapshot.tick = ++tick;
+        snapshot.prevTime = prevTime;
+        snapshot.time = time;
+        const Position &boatPos = world.get<Position>(boat);
+        snapshot.prevBoatPos = teleported ? boatPos.value : boatPos.prev;
+        snapshot.boatPos = boatPos.value;
+        snapshot.score = score;
+        snapshot.state = state;
+        snapshot.input = appliedInput;
+        // the rocks of the live chunks, one after the other
+        snapshot.rocks.resize(rocks.count());
+        size_t n = 0;
+        for (size_t c = 0; c < rocks.chunkCount(); c++)
+        {
+            for (size_t i = rocks.chunkBegin(c); i < rocks.chunkEnd(c); i++, n++)
+            {
+                // rocks only move towards the boat: if one went back its slot
+                // was given to a new chunk
+                glm::vec3 pos = rocks.getPos(i);
+                bool spawned = teleported || pos.z > prevRockZ[i];
+                snapshot.rocks[n].prevPos = spawned ? pos : glm::vec3(prevRockX[i], 0.0f, prevRockZ[i]);
+                snapshot.rocks[n].pos = pos;
+                snapshot.rocks[n].scalingFactor = glm::vec3(rocks.scale[i]);
+                snapshot.rocks[n].rotation = rocks.rotation[i];
+                snapshot.rocks[n].type = rocks.type[i];
+            }
+        }
+        snapshot.publishTime = steadyTime();
+        snapshots.publish();
+        teleported = false;
+        // the renderer slows down while the game is over, it has to know
+        // right away when it starts again
+        if (state != publishedState)
+        {
+            publishedState = state;
+            wakeRenderThread();
+        }
+    }
 
-        gubo.view = glm::lookAt(scaleVector(boat.getPos(), boatMotionDisplacement) + camPosDisplacement, scaleVector(boat.getPos(), boatMotionDisplacement) + camDelta, yAxis);
+    // Render thread: turns the latest snapshot into GPU data, never waits for
+    // the simulation (before its first tick the snapshot has no rocks).
+    // The frame shows the game between the last two ticks, alpha of the way
+    // from the previous one: it lags one tick behind, but moves smoothly at any
+    // frame rate.
+    // How far the renderer is between the previous tick and the last
+    // published one, in [0, 1]
+    float interpolationFactor(const GameSnapshot &snapshot)
+    {
+        return glm::clamp((float)((steadyTime() - snapshot.publishTime) * simulationRate), 0.0f, 1.0f);
+    }
+
+    // The camera follows the boat
+    globalUniformBufferObject cameraUniforms(glm::vec3 boatPos)
+    {
+        globalUniformBufferObject gubo{};
+        glm::vec3 position = scaleVector(boatPos, boatMotionDisplacement) + camPosDisplacement;
+        gubo.view = glm::lookAt(position, scaleVector(boatPos, boatMotionDisplacement) + camDelta, yAxis);
         gubo.proj = glm::perspective(FoV, swapChainExtent.width / (float)swapChainExtent.height, nearPlane, farPlane);
         gubo.proj[1][1] *= -1;
+        return gubo;
+    }
 
-        // First we draw the skybox, then the camera position
-        subo.mMat = I;
-        subo.nMat = I;
-        subo.mvpMat = gubo.proj * glm::lookAt(scaleVector(initialBoatPosition, 0.1f) + camPosDisplacement, scaleVector(initialBoatPosition, 0.1f) + camDelta, yAxis);
-        subo.mvpMat = glm::scale(subo.mvpMat, sbScalingFactor);
+    // The boat is scaled, then rotated and translated: the scale is uniform,
+    // so it also applies to the rotated translation
+    void boatTransform(glm::vec3 boatPos, float time, glm::vec3 &translation, glm::quat &rotation)
+    {
+        float angle = glm::radians(sin(2 * time));
+        rotation = glm::angleAxis(angle, xAxis) * glm::angleAxis(angle, zAxis); // boat and ocean oscillation
+        // translating boat according to players input, and down in the water
+        translation = boatScalingFactor * (rotation * (boatPos + glm::vec3(0, -0.8f, 0)));
+    }
 
-        vkMapMemory(device, skybox.DS.uniformBuffersMemory[0][currentImage], 0, sizeof(subo), 0, &data);
-        memcpy(data, &subo, sizeof(subo));
-        vkUnmapMemory(device, skybox.DS.uniformBuffersMemory[0][currentImage]);
+    glm::mat4 boatModel(glm::vec3 boatPos, float time)
+    {
+        glm::vec3 translation;
+        glm::quat rotation;
+        boatTransform(boatPos, time, translation, rotation);
+        return TransformSystem::compose(translation, rotation, boatScalingFactor);
+    }
 
-        // Now we can proceed with the camera position
-        vkMapMemory(device, DS_global.uniformBuffersMemory[0][currentImage], 0, sizeof(gubo), 0, &data);
-        memcpy(data, &gubo, sizeof(gubo));
-        vkUnmapMemory(device, DS_global.uniformBuffersMemory[0][currentImage]);
+    // The command buffer is recorded, but not submitted yet: the simulation
+    // may have published a new tick in the meantime, with the input received
+    // during the recording. The boat and the camera are moved there, the rest
+    // of the scene (and the culling, done with the old position) is left as is
+    void lateLatch(uint32_t currentFrame)
+    {
+        const GameSnapshot &snapshot = snapshots.read();
+        float alpha = interpolationFactor(snapshot);
+        float time = glm::mix(snapshot.prevTime, snapshot.time, alpha);
+        glm::vec3 boatPos = glm::mix(snapshot.prevBoatPos, snapshot.boatPos, alpha);
 
-        // Boat
-        ubo.model = I;
-        ubo.model = glm::scale(ubo.model, boatScalingFactor);                   // scale the model
-        ubo.model = glm::rotate(ubo.model, glm::radians(sin(2 * time)), xAxis); // boat oscillation
-        ubo.model = glm::rotate(ubo.model, glm::radians(sin(2 * time)), zAxis); // ocean oscillation
-        ubo.model = glm::translate(ubo.model, boat.getPos());                   // translating boat according to players input
-        ubo.model = glm::translate(ubo.model, glm::vec3(0, -0.8f, 0));          // translating the boat down in the water
+        globalUniformBufferObject gubo = cameraUniforms(boatPos);
+        UniformBufferObject ubo{};
+        ubo.model = boatModel(boatPos, time);
+        memcpy(globalUniforms[currentFrame], &gubo, sizeof(gubo));
+        memcpy(objectUniforms[world.get<Transform>(boat).id * framesInFlight + currentFrame], &ubo, sizeof(ubo));
+        latchInput(currentFrame, snapshot.input);
+    }
+
+    void updateUniformBuffer(uint32_t currentFrame)
+    {
+        const GameSnapshot &snapshot = snapshots.read();
+        float alpha = interpolationFactor(snapshot);
+        float time = glm::mix(snapshot.prevTime, snapshot.time, alpha);
+        glm::vec3 boatPos = glm::mix(snapshot.prevBoatPos, snapshot.boatPos, alpha);
+
+        SkyBoxUniformBufferObject subo{};
+        UniformBufferObject ubo{};
+
+        void *data;
+
+        cameraPosition = scaleVector(boatPos, boatMotionDisplacement) + camPosDisplacement;
+        globalUniformBufferObject gubo = cameraUniforms(boatPos);
+        viewMatrix = gubo.view;
+        viewProjMatrix = gubo.proj * gubo.view;
 
-        vkMapMemory(device, boat.getDS().uniformBuffersMemory[0][currentImage], 0, sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device, boat.getDS().uniformBuffersMemory[0][currentImage]);
+        // First we draw the skybox, which only changes with the aspect ratio
+        // of the window, then the camera position
+        uint8_t frameBit = (uint8_t)(1 << currentFrame);
+        if (skyboxStale & frameBit)
+        {
+            subo.mMat = glm::mat4(1.0f);
+            subo.nMat = glm::mat4(1.0f);
+            subo.mvpMat = gubo.proj * glm::lookAt(scaleVector(initialBoatPosition, 0.1f) + camPosDisplacement, scaleVector(initialBoatPosition, 0.1f) + camDelta, yAxis);
+            subo.mvpMat = glm::scale(subo.mvpMat, sbScalingFactor);
+
+            vkMapMemory(device, skybox.DS.uniformBuffersMemory[0][currentFrame], 0, sizeof(subo), 0, &data);
+            memcpy(data, &subo, sizeof(subo));
+            vkUnmapMemory(device, skybox.DS.uniformBuffersMemory[0][currentFrame]);
+            skyboxStale &= ~frameBit;
+        }
 
-        // Ocean
-        ubo.model = I;
-        ubo.model = glm::scale(ubo.model, oceanScalingFactor);                     // scale the model
-        ubo.model = glm::rotate(ubo.model, glm::radians(0.5f * sin(time)), zAxis); // ocean oscillation
-        ubo.model = glm::translate(ubo.model, glm::vec3(0, -0.005f, 0));           // translating the ocean down so that it is always under the boat
-        ubo.model = glm::scale(ubo.model, glm::vec3(1, 0.5f, 1));                  // making it shorter in height so that it doesn't cover the boat
+        // Now we can proceed with the camera position
+        memcpy(globalUniforms[currentFrame], &gubo, sizeof(gubo));
 
-        vkMapMemory(device, ocean.getDS().uniformBuffersMemory[0][currentImage], 0, sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device, ocean.getDS().uniformBuffersMemory[0][currentImage]);
+        // The transforms are only set here: the ones that did not change are
+        // neither composed again nor uploaded (e.g. the rocks after a game over)
+        // Boat
+        glm::vec3 translation;
+        glm::quat rotation;
+        uint32_t boatId = world.get<Transform>(boat).id;
+        boatTransform(boatPos, time, translation, rotation);
+        transforms.setTranslation(boatId, translation);
+        transforms.setRotation(boatId, rotation);
+
+        // Ocean, the scale was set once by localInit
+        uint32_t oceanId = world.get<Transform>(ocean).id;
+        rotation = glm::angleAxis(glm::radians(0.5f * sin(time)), zAxis); // ocean oscillation
+        transforms.setRotation(oceanId, rotation);
+        // translating the ocean down so that it is always under the boat
+        transforms.setTranslation(oceanId, oceanScalingFactor * (rotation * glm::vec3(0, -0.005f, 0)));
+
+        // Rocks: set, composed and uploaded by jobs, each one on its own
+        // groups of 4 transforms (the first one also composes the objects)
+        vkMapMemory(device, DS_cull.uniformBuffersMemory[CULL_OBJECTS][currentFrame], 0, rockCapacity * sizeof(ObjectData), 0, &data);
+        ObjectData *objects = static_cast<ObjectData *>(data);
+        size_t groups = (transforms.size() + 3) / 4;
+        jobs.parallelFor(groups, transformGroupsPerJob, [&](size_t begin, size_t end)
+                         { updateRockTransforms(snapshot, alpha, currentFrame, objects, begin * 4, std::min(end * 4, transforms.size())); });
+        vkUnmapMemory(device, DS_cull.uniformBuffersMemory[CULL_OBJECTS][currentFrame]);
+
+        // Objects, lateLatch writes the boat again right before the submission
+        world.each<Transform>([&](size_t count, Entity *, Transform *transform)
+                              {
+                                  for (size_t i = 0; i < count; i++)
+                                  {
+                                      uint32_t id = transform[i].id;
+                                      if (transforms.takeStale(id, currentFrame))
+                                      {
+                                          ubo.model = transforms.matrices[id];
+                                          memcpy(objectUniforms[id * framesInFlight + currentFrame], &ubo, sizeof(ubo));
+                                      }
+                                  } });
+
+        CullParams params{};
+        params.viewProj = viewProjMatrix;
+        params.prevViewProj = prevViewProjMatrix;
+        params.pyramid = glm::vec4(depthPyramid.width, depthPyramid.height, depthPyramid.levels,
+                                   depthPyramid.built ? 1.0f : 0.0f);
+        prevViewProjMatrix = viewProjMatrix;
+        Frustum frustum = Frustum::fromMatrix(viewProjMatrix);
+        for (int p = 0; p < 6; p++)
+        {
+            params.planes[p] = frustum.planes[p];
+        }
+        params.cameraPos = glm::vec4(cameraPosition, 1.0f);
+        params.lodDistances = rockLodDistances;
+        params.objectCount = (uint32_t)snapshot.rocks.size();
+        params.capacity = rockCapacity;
+        frameRockCounts[currentFrame] = params.objectCount;
+        params.meshCount = rockMeshCount;
+
+        vkMapMemory(device, DS_cull.uniformBuffersMemory[CULL_PARAMS][currentFrame], 0, sizeof(params), 0, &data);
+        memcpy(data, &params, sizeof(params));
+        vkUnmapMemory(device, DS_cull.uniformBuffersMemory[CULL_PARAMS][currentFrame]);
+    }
 
-        // Rocks
-        for (auto &r : rocks)
+    // Transforms first to last (whole groups of 4) with the rocks in
+    // snapshot: they are scaled, then translated and rotated, with a uniform
+    // scale. Only the stale ones are written to objects.
+    void updateRockTransforms(const GameSnapshot &snapshot, float alpha, uint32_t currentFrame,
+                              ObjectData *objects, size_t first, size_t last)
+    {
+        size_t rocksBegin = std::max(first, (size_t)firstRockTransform);
+        size_t rocksEnd = std::min(last, firstRockTransform + snapshot.rocks.size());
+        for (size_t id = rocksBegin; id < rocksEnd; id++)
         {
-            ubo.model = I;
-            ubo.model = glm::scale(ubo.model, r.getScalingFactor()); // randomly generated size accourding to a normal distribution
-            ubo.model = glm::translate(ubo.model, r.getPos());       // adjusting position according to game logic
-            ubo.model = glm::rotate(ubo.model, r.getRot(), yAxis);   // randomly generated rotation accourding to a normal distribution
+            size_t i = id - firstRockTransform;
+            const RockSnapshot &r = snapshot.rocks[i];
+            transforms.setScale(id, r.scalingFactor);                                           // randomly generated size accourding to a normal distribution
+            transforms.setTranslation(id, r.scalingFactor * glm::mix(r.prevPos, r.pos, alpha)); // adjusting position according to game logic
+            if (rockAngles[i] != r.rotation)
+            {
+                rockAngles[i] = r.rotation;
+                transforms.setRotation(id, glm::angleAxis(r.rotation, yAxis)); // randomly generated rotation accourding to a normal distribution
+            }
+        }
+
+        transforms.update(first, last);
 
-            vkMapMemory(device, r.getDS().uniformBuffersMemory[0][currentImage], 0, sizeof(ubo), 0, &data);
-            memcpy(data, &ubo, sizeof(ubo));
-            vkUnmapMemory(device, r.getDS().uniformBuffersMemory[0][currentImage]);
+        // only their transforms are uploaded, straight into the object buffer
+        for (size_t id = rocksBegin; id < rocksEnd; id++)
+        {
+            if (transforms.takeStale(id, currentFrame))
+            {
+                size_t i = id - firstRockTransform;
+                objects[i].model = transforms.matrices[id];
+                objects[i].mesh = glm::uvec4(snapshot.rocks[i].type, 0, 0, 0);
+            }
         }
     }
 
     // Here we handle object motion
-    void updatePosition(float accelerationFactor, float time)
+    void updatePosition(float accelerationFactor, float time, float dt)
     {
         static bool isJumping = false;
         static float jumpTime;
 
         // game restart logic
-        if (glfwGetKey(window, GLFW_KEY_R) && state == GAME_OVER)
+        if (isKeyDown(GLFW_KEY_R) && state == GAME_OVER)
         {
             std::cout << "Restarting the game..." << std::endl;
             initGame();
@@ -710,38 +1589,35 @@ protected:
             return;
         }
 
-        for (auto &r : rocks)
+        // Speed increases with time (up to a certain limit given by maxAcceleration).
+        // The chunks of the course that get behind the boat are dropped
+        // and new ones are generated beyond the horizon
+        // to give the illusion of an infinite amount of rocks
+        rockStep = (rocks.speedFactor + accelerationFactor) * dt;
+        rocks.advance(rockStep, maxDepth);
+        streamCourse();
+
+        // Boat motion: the keys set its velocity, moveObjects applies it
+        glm::vec3 &velocity = world.get<Velocity>(boat).linear;
+        velocity = glm::vec3(0.0f);
+        if (isKeyDown(GLFW_KEY_A))
         {
-            // Speed increases with time (up to a certain limit given by maxAcceleration)
-            r.moveForward(accelerationFactor);
-            // When rocks get behind the boat they are moved
-            // again in the field of view far from the boat
-            // to give the illusion of an infinite amount of rocks
-            if (r.getPos().z < maxDepth)
-            {
-                r.reset();
-            }
+            velocity.x += boatSpeed;
         }
-
-        // Boat motion
-        if (glfwGetKey(window, GLFW_KEY_A))
+        if (isKeyDown(GLFW_KEY_D))
         {
-            boat.moveLeft();
+            velocity.x -= boatSpeed;
         }
-        if (glfwGetKey(window, GLFW_KEY_D))
+        if (isKeyDown(GLFW_KEY_W))
         {
-            boat.moveRight();
+            velocity.z += boatSpeed * 0.33f;
         }
-        if (glfwGetKey(window, GLFW_KEY_W))
+        if (isKeyDown(GLFW_KEY_S))
         {
-            boat.moveForward();
-        }
-        if (glfwGetKey(window, GLFW_KEY_S))
-        {
-            boat.moveBackward();
+            velocity.z -= boatSpeed * 0.33f;
         }
 
-        if (glfwGetKey(window, GLFW_KEY_SPACE))
+        if (isKeyDown(GLFW_KEY_SPACE))
         {
             if (!isJumping)
             {
@@ -753,18 +1629,32 @@ protected:
         {
             if (time - jumpTime < 0.2f)
             {
-                boat.jump();
+                velocity.y = boatSpeed * 0.66f;
             }
             else if ((time - jumpTime) > 0.25f && (time - jumpTime) < 0.45f)
             {
-                boat.fall();
-            }
-            else if (time - jumpTime > 0.45f)
-            {
-                boat.setPos(glm::vec3(boat.getPos().x, 0.0f, boat.getPos().z));
-                isJumping = false;
+                velocity.y = -boatSpeed * 0.66f;
             }
         }
+
+        moveObjects(dt);
+
+        if (isJumping && time - jumpTime > 0.45f)
+        {
+            world.get<Position>(boat).value.y = 0.0f;
+            isJumping = false;
+        }
+    }
+
+    // Every object with a velocity moves along the tick
+    void moveObjects(float dt)
+    {
+        world.each<Position, Velocity>([dt](size_t count, Entity *, Position *position, Velocity *velocity)
+                                       {
+                                           for (size_t i = 0; i < count; i++)
+                                           {
+                                               position[i].value += velocity[i].linear * dt;
+                                           } });
     }
 
     // check for collisions beteween boat and rocks
@@ -772,77 +1662,122 @@ protected:
     // to its original position thanks to the initGame function
     void detectCollisions()
     {
-        /* debugging purposes
-         * if(!glm::all(glm::equal(boat.getPos(), oldBoatPos))) {
-         * 	boat.printPos();
-         * 	oldBoatPos = boat.getPos();
-         * } */
-
-        for (auto &r : rocks)
+        // if some rocks ends up inside the area of a collider
+        // then we have a collision (a jumping boat clears every rock).
+        // Colliders and rocks are tested as they are drawn: the model
+        // matrices scale their positions as well (the oscillation of the boat
+        // is left out, it is about one degree).
+        // Fast rocks can move farther than the length of the boat in a tick,
+        // more so at low tick rates: the test is swept over the whole tick,
+        // from where the colliders and the rocks were at its start
+        colliderAreas.clear();
+        colliderShapes.clear();
+        colliderMotions.clear();
+        world.each<Position, Collider>([&](size_t count, Entity *, Position *position, Collider *collider)
+                                       {
+                                           for (size_t i = 0; i < count; i++)
+                                           {
+                                               glm::vec3 pos = position[i].value;
+                                               if (rockHeight < pos.y - collider[i].height / 3)
+                                               {
+                                                   continue;
+                                               }
+                                               glm::vec3 start = teleported ? pos : position[i].prev;
+                                               glm::vec2 motion = collider[i].scale * glm::vec2(pos.x - start.x, pos.z - start.z);
+                                               colliderShapes.emplace_back();
+                                               colliderMotions.push_back(motion);
+                                               colliderAreas.push_back(colliderArea(*collider[i].footprint, collider[i].scale, start, motion, colliderShapes.back()));
+                                           } });
+        collisionPairs.clear();
+        rocks.sweep(colliderAreas, collisionPairs);
+        long hit = -1;
+        float hitTime = 1.0f;
+        for (const CollisionPair &pair : collisionPairs)
+        {
+            const glm::vec4 &area = colliderAreas[pair.box];
+            uint32_t r = pair.rock;
+            if (rocks.x[r] < area.x || rocks.x[r] > area.y)
+            {
+                continue;
+            }
+            // the rock under its own scale and rotation, moving towards the
+            // collider (new ones start beyond the horizon, out of reach)
+            float scale = rocks.scale[r];
+            rockFootprints[rocks.type[r]].place(scale, rocks.rotation[r], glm::vec2(rocks.x[r], rocks.z[r] + rockStep), rockShape);
+            glm::vec2 motion = glm::vec2(0.0f, -scale * rockStep) - colliderMotions[pair.box];
+            float time;
+            // the first rock hit is the one that stops the game
+            if (FootprintsSweep(colliderShapes[pair.box], rockShape, motion, time) && (hit < 0 || time < hitTime))
+            {
+                hit = r;
+                hitTime = time;
+            }
+        }
+        if (hit >= 0 && !invulnerable)
         {
             /* debugging purposes
-             * if(r.getType() == 0) {
-             * 	r.printPos();
-             * } */
-
-            // if some rocks ends up with the same inside the area
-            // defined by the boat coordinates plus some margin
-            // then we have a collision
-            if (r.getPos().x <= boat.getPos().x + boatLength / 2 && r.getPos().x >= boat.getPos().x - boatLength / 2)
+             * printf("Collided in (%.1f, %.1f, %.1f) with rock %ld.\n", rocks.x[hit], 0.0f, rocks.z[hit], hit); */
+            std::cout << ESC << RED << "Final score: " << score << RESET << std::endl;
+            std::cout << "Press R to restart." << std::endl;
+
+            // setting high score if necessary
+            if (score > highScore)
             {
-                if (r.getPos().z <= boat.getPos().z + boatWidth / 2 && r.getPos().z >= boat.getPos().z - boatWidth / 2)
+                highScore = score;
+                std::cout << ESC << GREEN << "New High Score: " << highScore << RESET << std::endl;
+
+                if (writeScore("highscore.dat", highScore))
                 {
-                    if (rockHeight >= boat.getPos().y - boatHeight / 3)
-                    {
-                        /* debugging purposes
-                         * printf("Collided in (%.1f, %.1f, %.1f) with rock %d. Boat position: (%.1f, %.1f, %.1f).\n", r.getPos().x, r.getPos().y, r.getPos().z, r.getId(), boat.getPos().x, boat.getPos().y, boat.getPos().z); */
-                        std::cout << ESC << RED << "Final score: " << score << RESET << std::endl;
-                        std::cout << "Press R to restart." << std::endl;
-
-                        // setting high score if necessary
-                        if (score > highScore)
-                        {
-                            highScore = score;
-                            std::cout << ESC << GREEN << "New High Score: " << highScore << RESET << std::endl;
-
-                            if (writeScore("highscore.dat", highScore))
-                            {
-                                std::cout << "High Score written to file." << std::endl;
-                            }
-                            else
-                            {
-                                std::cout << "Failed to write High Score to file." << std::endl;
-                            }
-                        }
-                        // here we just change the state of the game,
-                        // the actual reset of initial game conditions
-                        // is done by the initGame function called by updatePosition
-                        state = GAME_OVER;
-                    }
+                    std::cout << "High Score written to file." << std::endl;
+                }
+                else
+                {
+                    std::cout << "Failed to write High Score to file." << std::endl;
                 }
             }
+            // here we just change the state of the game,
+            // the actual reset of initial game conditions
+            // is done by the initGame function called by updatePosition
+            state = GAME_OVER;
         }
     }
 
-    // checking that boat position stays between a given range
-    void checkBoatBoundaries()
+    // Places footprint at scale * start, in shape, and returns the broadphase
+    // box of the collider. The broadphase works on the rock positions before
+    // scaling: the box holds the ones that could reach the collider along its
+    // motion, whatever their scale, and were rockStep farther at the start of
+    // the tick. Only the rocks level with it are given to the narrow phase
+    glm::vec4 colliderArea(const Footprint &footprint, float scale, glm::vec3 start, glm::vec2 motion, WorldFootprint &shape)
     {
-        if (boat.getPos().x > leftBound)
-        {
-            boat.setPos(glm::vec3(leftBound, boat.getPos().y, boat.getPos().z));
-        }
-        if (boat.getPos().x < rightBound)
-        {
-            boat.setPos(glm::vec3(rightBound, boat.getPos().y, boat.getPos().z));
-        }
-        if (boat.getPos().z < backwardBound)
-        {
-            boat.setPos(glm::vec3(boat.getPos().x, boat.getPos().y, backwardBound));
-        }
-        if (boat.getPos().z > forwardBound)
+        footprint.place(scale, 0.0f, glm::vec2(start.x, start.z), shape);
+        glm::vec2 areaX(shape.x[0]), areaZ(shape.z[0]);
+        for (int i = 1; i < 8; i++)
         {
-            boat.setPos(glm::vec3(boat.getPos().x, boat.getPos().y, forwardBound));
+            areaX = glm::vec2(std::min(areaX.x, shape.x[i]), std::max(areaX.y, shape.x[i]));
+            areaZ = glm::vec2(std::min(areaZ.x, shape.z[i]), std::max(areaZ.y, shape.z[i]));
         }
+        areaX += glm::vec2(std::min(motion.x, 0.0f), std::max(motion.x, 0.0f));
+        areaZ += glm::vec2(std::min(motion.y, 0.0f), std::max(motion.y, 0.0f));
+        glm::vec2 reachX = reachingPositions(areaX), reachZ = reachingPositions(areaZ);
+        return glm::vec4(reachX.x, reachX.y, reachZ.x - rockStep, reachZ.y);
+    }
+
+    // Positions (before scaling) of the rocks that can reach the world
+    // interval [bounds.x, bounds.y], with any scale: a rock of scale s at p
+    // covers s * (p - rockReach) to s * (p + rockReach)
+    glm::vec2 reachingPositions(glm::vec2 bounds)
+    {
+        float low = bounds.x / (bounds.x >= 0 ? maxRockScalingFactor : minRockScalingFactor);
+        float high = bounds.y / (bounds.y >= 0 ? minRockScalingFactor : maxRockScalingFactor);
+        return glm::vec2(low - rockReach, high + rockReach);
+    }
+
+    // checking that boat position stays between a given range
+    void checkBoatBoundaries()
+    {
+        glm::vec3 &pos = world.get<Position>(boat).value;
+        pos.x = glm::clamp(pos.x, rightBound, leftBound);
+        pos.z = glm::clamp(pos.z, backwardBound, forwardBound);
     }
 
     void initGame()
@@ -851,12 +1786,49 @@ protected:
         score = 0.0f;
         accFactor = 0.0f;
         state = PLAY;
+        teleported = true;
 
-        cameraPosition = initialCameraPosition;
-        boat.reset();
-        for (auto &r : rocks)
+        world.get<Position>(boat) = Position{initialBoatPosition, initialBoatPosition};
+        // the chunk being generated belongs to the old course
+        if (courseJob.running)
         {
-            r.reset();
+            jobs.wait(courseJob.counter);
+            courseJob.running = false;
+        }
+        rocks.resetAll();
+    }
+
+    // The chunks ahead of the boat are generated by a job, one at a time,
+    // while the simulation goes on: it only waits for one that is already
+    // due at the horizon (with a single core, that is when it gets run)
+    void streamCourse()
+    {
+        while (true)
+        {
+            if (courseJob.running)
+            {
+                if (!rocks.needed(courseJob.index) && !jobs.done(courseJob.counter))
+                {
+                    return;
+                }
+                jobs.wait(courseJob.counter);
+                courseJob.running = false;
+                rocks.insert(courseJob.chunk);
+            }
+            if (!rocks.wanted(rocks.nextChunk()))
+            {
+                return;
+            }
+            courseJob.course = rocks.course;
+            courseJob.index = rocks.nextChunk();
+            courseJob.job.function = [](void *data, size_t, size_t)
+            {
+                CourseJob *course = static_cast<CourseJob *>(data);
+                generateChunk(course->course, course->index, course->chunk);
+            };
+            courseJob.job.data = &courseJob;
+            jobs.schedule(courseJob.job, courseJob.counter);
+            courseJob.running = true;
         }
     }
 
@@ -905,18 +1877,460 @@ protected:
         std::cout << "Press D to move right." << std::endl;
         std::cout << "Press SPACE to jump." << std::endl;
         std::cout << "Press R to restart the game at gameover." << std::endl;
+        std::cout << "Press F11 to toggle fullscreen." << std::endl;
+        std::cout << "Press F10 to change the present mode." << std::endl;
     }
 
     glm::vec3 scaleVector(glm::vec3 v, float s)
     {
         return glm::vec3(v.x * s, v.y * s, v.z * s);
     }
+
+public:
+    // Storm mode: count rocks instead of 10 to 15, must be called before run()
+    void setStormRocks(int count)
+    {
+        stormRockCount = std::max(0, count);
+    }
+
+    // The boat goes through the rocks: a game that never ends, for the checks
+    void setInvulnerable(bool value)
+    {
+        invulnerable = value;
+    }
 };
 
-int main()
+// Rocks as they are after a while: a course of count rocks (at the start)
+// spread between the boat and the horizon, a little past its start
+static RockField steadyRocks(int count, float dt)
+{
+    RockField rocks;
+    rocks.init(count, Random(count));
+    for (int t = 0; t < (farPlane + rockGenDelta) / (rocks.speedFactor * dt); t++)
+    {
+        rocks.advance(rocks.speedFactor * dt, maxDepth);
+        rocks.generateAhead();
+    }
+    return rocks;
+}
+
+// Cost of a simulation tick for the rocks (forward motion, the chunks retired
+// and generated, here on the simulation thread, and the collision test), in
+// ns per rock, for each kernel the CPU can run. Every kernel starts from the
+// same rocks and runs about 50 million rock updates.
+static void benchmarkRocks()
+{
+    const int counts[] = {15, 1000, 100000};
+    const float dt = 1.0f / 120.0f;
+    const glm::vec4 area(-boatLength / 2, boatLength / 2, -boatWidth / 2, boatWidth / 2);
+
+    std::cout << "rocks\tkernel\tns/rock" << std::endl;
+    for (int count : counts)
+    {
+        RockField initial = steadyRocks(count, dt);
+        int ticks = std::max(100, 50000000 / count);
+        for (int p = SIMD_SCALAR; p <= SIMD_AVX2; p++)
+        {
+            if (!RockField::pathSupported((SimdPath)p))
+            {
+                continue;
+            }
+            RockField rocks = initial;
+            rocks.path = (SimdPath)p; // the copy plays the same course
+            size_t retired = 0;
+            long hits = 0;
+            auto start = chrono::steady_clock::now();
+            for (int t = 0; t < ticks; t++)
+            {
+                retired += rocks.advance(rocks.speedFactor * dt, maxDepth);
+                rocks.generateAhead();
+                hits += rocks.findInBox(area) >= 0;
+            }
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            // retired and hits keep the work from being optimized away
+            std::cout << count << "\t" << SimdPathName[p] << "\t" << ns / ((double)ticks * count)
+                      << "\t(" << retired << " retired, " << hits << " hits)" << std::endl;
+        }
+    }
+
+    // Broadphase against brute force, for storm mode: every boat in its own
+    // part of the lane, all the overlapping (boat, rock) pairs are collected.
+    // Both include the motion of the rocks, the course stays sorted by itself.
+    std::cout << std::endl
+              << "rocks\tboats\tbrute force us/tick\tsweep us/tick\tpairs" << std::endl;
+    const int stormCounts[] = {1000, 10000, 100000};
+    const int boatCounts[] = {1, 8};
+    for (int count : stormCounts)
+    {
+        for (int boats : boatCounts)
+        {
+            vector<glm::vec4> areas;
+            for (int b = 0; b < boats; b++)
+            {
+                float x = rightBound + (b + 0.5f) * (leftBound - rightBound) / boats;
+                areas.push_back(glm::vec4(x - boatLength / 2, x + boatLength / 2, -boatWidth / 2, boatWidth / 2));
+            }
+            RockField initial = steadyRocks(count, dt);
+            int ticks = std::max(50, 5000000 / count);
+            double us[2];
+            size_t pairCount[2] = {0, 0};
+            for (int method = 0; method < 2; method++)
+            {
+                RockField rocks = initial;
+                vector<CollisionPair> pairs; // the copy plays the same course
+                auto start = chrono::steady_clock::now();
+                for (int t = 0; t < ticks; t++)
+                {
+                    rocks.advance(rocks.speedFactor * dt, maxDepth);
+                    rocks.generateAhead();
+                    pairs.clear();
+                    if (method == 0)
+                    {
+                        rocks.bruteForce(areas, pairs);
+                    }
+                    else
+                    {
+                        rocks.sweep(areas, pairs);
+                        // narrow phase
+                        pairs.erase(remove_if(pairs.begin(), pairs.end(), [&](const CollisionPair &pair)
+                                              { return rocks.x[pair.rock] < areas[pair.box].x ||
+                                                       rocks.x[pair.rock] > areas[pair.box].y; }),
+                                    pairs.end());
+                    }
+                    pairCount[method] += pairs.size();
+                }
+                us[method] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / ticks;
+            }
+            std::cout << count << "\t" << boats << "\t" << us[0] << "\t\t\t" << us[1] << "\t\t"
+                      << pairCount[1] << (pairCount[0] == pairCount[1] ? "" : " (MISMATCH)") << std::endl;
+        }
+    }
+
+    // Narrow phase: a rock footprint placed under its scale and rotation and
+    // tested against the boat, for rocks all around it. The footprints are
+    // boxes of the size of the old collision areas, the cost does not depend
+    // on the meshes.
+    Footprint boatBox{glm::vec4(-boatLength / 2, -boatWidth / 2, -(boatLength + boatWidth) / 2, -(boatLength + boatWidth) / 2),
+                      glm::vec4(boatLength / 2, boatWidth / 2, (boatLength + boatWidth) / 2, (boatLength + boatWidth) / 2)};
+    Footprint rockBox{glm::vec4(-1.0f, -1.0f, -2.0f, -2.0f), glm::vec4(1.0f, 1.0f, 2.0f, 2.0f)};
+    WorldFootprint boatShape, rockShape;
+    boatBox.place(boatScalingFactor.x, 0.0f, glm::vec2(0.0f), boatShape);
+    const int pairs = 10000000;
+    long hits = 0;
+    Random random(pairs);
+    vector<glm::vec4> placements(1024); // x, z, scale, rotation
+    for (glm::vec4 &p : placements)
+    {
+        p = glm::vec4(random.uniform(-8.0f, 8.0f), random.uniform(-6.0f, 6.0f),
+                      random.uniform(minRockScalingFactor, maxRockScalingFactor), random.uniform(0.0f, 360.0f));
+    }
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < pairs; i++)
+    {
+        const glm::vec4 &p = placements[i % placements.size()];
+        rockBox.place(p.z, p.w, glm::vec2(p.x, p.y), rockShape);
+        hits += FootprintsOverlap(boatShape, rockShape);
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    std::cout << std::endl
+              << "narrow phase (" << (HAS_SSE ? "SSE" : "scalar") << "): " << ns / pairs << " ns/pair ("
+              << hits << " hits)" << std::endl;
+
+    // Tunnelling: rocks at top speed going past the boat, at lower and lower
+    // tick rates. The static test only sees the rocks overlapping the boat
+    // at the end of a tick, the swept one every rock that touched it.
+    std::cout << std::endl
+              << "ticks/s\tstep\trocks hit (static)\trocks hit (swept)" << std::endl;
+    const float tickRates[] = {120.0f, 60.0f, 30.0f, 10.0f};
+    for (float rate : tickRates)
+    {
+        float step = (rockSpeed + maxAcceleration) / rate;
+        int hitStatic = 0, hitSwept = 0;
+        random = Random(1000);
+        for (int r = 0; r < 1000; r++)
+        {
+            glm::vec4 p(random.uniform(-4.0f, 4.0f), 0.0f,
+                        random.uniform(minRockScalingFactor, maxRockScalingFactor), random.uniform(0.0f, 360.0f));
+            bool overlapped = false, swept = false;
+            for (float z = 40.0f; z > -40.0f; z -= step)
+            {
+                float time;
+                rockBox.place(p.z, p.w, glm::vec2(p.x, z), rockShape);
+                swept |= FootprintsSweep(boatShape, rockShape, glm::vec2(0.0f, -p.z * step), time);
+                rockBox.place(p.z, p.w, glm::vec2(p.x, z - step), rockShape);
+                overlapped |= FootprintsOverlap(boatShape, rockShape);
+            }
+            hitStatic += overlapped;
+            hitSwept += swept;
+        }
+        std::cout << rate << "\t" << step << "\t" << hitStatic << "\t\t\t" << hitSwept << std::endl;
+    }
+}
+
+// Model matrices composed per second: the glm::scale / translate / rotate
+// chain the rocks used to be built with, against TransformSystem with every
+// object dirty (all the rocks moving) and with one in a hundred dirty
+static void benchmarkTransforms()
+{
+    const int count = 100000;
+    const int rounds = 100;
+    TransformSystem transforms;
+    transforms.init(count, 1);
+    vector<glm::mat4> chained(count);
+    vector<glm::vec4> rocks(count); // x, z, scale, rotation
+    Random random(count);
+    for (int i = 0; i < count; i++)
+    {
+        rocks[i] = glm::vec4(random.uniform(rightBound, leftBound), random.uniform(farPlane, farPlane + rockGenDelta),
+                             random.uniform(minRockScalingFactor, maxRockScalingFactor), random.uniform(0.0f, 360.0f));
+        transforms.setScale(i, glm::vec3(rocks[i].z));
+        transforms.setRotation(i, glm::angleAxis(rocks[i].w, yAxis));
+    }
+
+    std::cout << std::endl
+              << "transforms\tmatrices/s" << std::endl;
+    auto start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            glm::mat4 model = glm::scale(glm::mat4(1.0f), glm::vec3(rocks[i].z));
+            model = glm::translate(model, glm::vec3(rocks[i].x, 0.0f, rocks[i].y - round));
+            chained[i] = glm::rotate(model, rocks[i].w, yAxis);
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "glm chain\t" << (double)count * rounds / seconds << std::endl;
+
+    const int strides[] = {1, 100};
+    for (int stride : strides)
+    {
+        size_t composed = 0;
+        start = chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++)
+        {
+            for (int i = 0; i < count; i += stride)
+            {
+                transforms.setTranslation(i, rocks[i].z * glm::vec3(rocks[i].x, 0.0f, rocks[i].y - round));
+            }
+            composed += transforms.update();
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        std::cout << "TRS " << (HAS_SSE ? "SSE" : "scalar") << ", 1/" << stride << " dirty\t"
+                  << (double)composed / seconds << "\t(" << (double)count * rounds / seconds << " objects/s)" << std::endl;
+    }
+
+    // both give the same matrices, up to rounding
+    float error = 0.0f;
+    for (int i = 0; i < count; i++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            glm::vec4 d = glm::abs(chained[i][c] - transforms.matrices[i][c]);
+            error = std::max(error, std::max(std::max(d.x, d.y), std::max(d.z, d.w)));
+        }
+    }
+    std::cout << "largest difference: " << error << std::endl;
+}
+
+// Obstacles as entities, half of them with a collider: the systems walk the
+// chunks of two archetypes
+static void benchmarkEntities()
+{
+    const int count = 100000;
+    const int rounds = 100;
+    const float dt = 1.0f / 120;
+    EntityWorld world;
+    vector<Entity> entities;
+    Random random(count);
+
+    std::cout << std::endl
+              << "entities\tns/entity" << std::endl;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 pos(random.uniform(rightBound, leftBound), 0.0f, random.uniform(farPlane, farPlane + rockGenDelta));
+        Velocity velocity{glm::vec3(0.0f, 0.0f, -rockSpeed)};
+        if (i % 2)
+        {
+            entities.push_back(world.create(Position{pos, pos}, velocity));
+        }
+        else
+        {
+            entities.push_back(world.create(Position{pos, pos}, velocity, Collider{nullptr, minRockScalingFactor, rockHeight}));
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "create\t\t" << seconds * 1e9 / count << std::endl;
+
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        world.each<Position, Velocity>([dt](size_t count, Entity *, Position *position, Velocity *velocity)
+                                       {
+                                           for (size_t i = 0; i < count; i++)
+                                           {
+                                               position[i].prev = position[i].value;
+                                               position[i].value += velocity[i].linear * dt;
+                                           } });
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "move\t\t" << seconds * 1e9 / ((double)count * rounds) << std::endl;
+
+    // half of the colliders lose it, every other entity is destroyed
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i += 4)
+    {
+        world.remove<Collider>(entities[i]);
+    }
+    for (int i = 1; i < count; i += 2)
+    {
+        world.destroy(entities[i]);
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "remove, destroy\t" << seconds * 1e9 / (count / 4 + count / 2) << std::endl;
+    std::cout << world.size() << " left" << std::endl;
+}
+
+// Random floats in the rock spawn range, from the C library generator (as
+// the game used to draw them), one xoshiro256** stream, and four in a batch
+static void benchmarkRandom()
+{
+    const int count = 1 << 20;
+    const int rounds = 20;
+    vector<float> numbers(count);
+    float sum = 0.0f;
+
+    std::cout << std::endl
+              << "random\t\tfloats/s" << std::endl;
+    srand(count);
+    auto start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            numbers[i] = rightBound + (leftBound - rightBound) * (rand() / (float)RAND_MAX);
+        }
+        sum += numbers[round];
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "rand()\t\t" << (double)count * rounds / seconds << std::endl;
+
+    Random random(count);
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            numbers[i] = random.uniform(rightBound, leftBound);
+        }
+        sum += numbers[round];
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "xoshiro256**\t" << (double)count * rounds / seconds << std::endl;
+
+    RandomBatch batch(random);
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        batch.fill(numbers.data(), count, rightBound, leftBound);
+        sum += numbers[round];
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "batch (" << (HAS_SSE ? "SSE2" : "scalar") << ")\t" << (double)count * rounds / seconds
+              << "\t(" << sum << ")" << std::endl;
+}
+
+int main(int argc, char *argv[])
 {
     BoatRunner app;
-    srand(time(0));
+    bool checkAllocations = false;
+
+    // --frames-in-flight N: how many frames the CPU may prepare while the GPU
+    // is still busy with the previous ones (1 to 3, default 2)
+    // --present-mode MODE: immediate for uncapped benchmarks, mailbox (default)
+    // or fifo/fifo-relaxed to sync with the display
+    // --fps N: frame rate limit while playing (default 0, no limit)
+    // --idle-fps N: frame rate after a game over or without focus (default
+    // 10, 0 only draws on input)
+    // --gpu-budget MS: GPU time of the scene per frame, without the swap chain
+    // blit, the resolution scales to (default 16.7, 0 for the full resolution)
+    // --bench: times the rock simulation kernels, the collision broadphase,
+    // the narrow phase, the transform system, the entity storage and the
+    // random numbers, without opening a window
+    // --storm N: storm mode, N rocks
+    // --tick-rate N: simulation ticks per second (default 120)
+    // --workers N: job system threads (default 0, one per core but one)
+    // --seed N: seed of the random numbers, to replay a run (default from
+    // the clock, printed at start)
+    // --check-allocations N: plays N frames, after a warm-up, with a boat
+    // that cannot crash, and fails if any of them allocated on the heap;
+    // needs the debug build (make debug), the only one counting allocations
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        VkPresentModeKHR presentMode;
+        if (arg == "--bench")
+        {
+            benchmarkRocks();
+            benchmarkTransforms();
+            benchmarkEntities();
+            benchmarkRandom();
+            return EXIT_SUCCESS;
+        }
+        else if (arg == "--storm" && i + 1 < argc)
+        {
+            app.setStormRocks(atoi(argv[++i]));
+        }
+        else if (arg == "--frames-in-flight" && i + 1 < argc)
+        {
+            app.setFramesInFlight(atoi(argv[++i]));
+        }
+        else if (arg == "--present-mode" && i + 1 < argc && ParsePresentMode(argv[i + 1], presentMode))
+        {
+            app.setPresentMode(presentMode);
+            i++;
+        }
+        else if (arg == "--fps" && i + 1 < argc)
+        {
+            app.setFrameRateLimit(atof(argv[++i]));
+        }
+        else if (arg == "--idle-fps" && i + 1 < argc)
+        {
+            app.setIdleFrameRate(atof(argv[++i]));
+        }
+        else if (arg == "--gpu-budget" && i + 1 < argc)
+        {
+            app.setGpuTimeBudget(atof(argv[++i]));
+        }
+        else if (arg == "--tick-rate" && i + 1 < argc)
+        {
+            app.setSimulationRate(atof(argv[++i]));
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            app.setJobWorkers(atoi(argv[++i]));
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            app.setRandomSeed(strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--check-allocations" && i + 1 < argc)
+        {
+            app.setAllocationCheck(strtoull(argv[++i], nullptr, 10));
+            app.setInvulnerable(true);
+            checkAllocations = true;
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--frames-in-flight 1-3]"
+                      << " [--present-mode immediate|mailbox|fifo|fifo-relaxed]"
+                      << " [--fps N] [--idle-fps N] [--gpu-budget MS] [--tick-rate N] [--workers N] [--seed N] [--check-allocations N] [--bench] [--storm N]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
     try
     {
         app.run();
@@ -927,5 +2341,13 @@ int main()
         return EXIT_FAILURE;
     }
 
+    if (checkAllocations && !app.allocationCheckPassed())
+    {
+        std::cerr << (COUNT_ALLOCATIONS ? "Allocation check failed: the frame loop allocated on the heap"
+                                        : "Allocation check failed: allocations are only counted by the debug build (make debug)")
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -7,19 +7,48 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAS_SSE 1
+#else  // e.g. Apple silicon
+#define HAS_SSE 0
+#endif
+
+// AVX2 code is compiled with a target attribute and only run if the CPU
+// supports it (__builtin_cpu_supports), so the build needs no -mavx2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAS_AVX2_TARGET 1
+#else
+#define HAS_AVX2_TARGET 0
+#endif
+
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
@@ -27,7 +56,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/epsilon.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/random.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/euler_angles.hpp>
 #include <glm/gtx/hash.hpp>
 #include <glm/gtx/string_cast.hpp>
@@ -75,7 +104,9 @@ static const string VERTEX_SHADER = "shaders/vert.spv";
 static const string ROCK_MODELS_PATH[2] = {"/Rock1Scaled.obj", "/Rock2.obj"};
 static const string ROCK_TEXTURES_PATH[2] = {"/Rock1.jpg", "/Rock2.jpg"};
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// Range of frames the CPU may record ahead of the GPU, see setFramesInFlight()
+const int MIN_FRAMES_IN_FLIGHT = 1;
+const int MAX_FRAMES_IN_FLIGHT = 3;
 
 // Lesson 22.0
 const std::vector<const char *> validationLayers = {
@@ -258,8 +289,81 @@ void PrintVkError(VkResult result) {
     std::cout << "Error: " << result << ", " << meaning << "\n";
 }
 
+// Present modes that can be requested, by name, on the command line
+struct presentmode {
+    VkPresentModeKHR mode;
+    std::string name;
+};
+
+const presentmode PresentModes[] = {
+    {VK_PRESENT_MODE_IMMEDIATE_KHR, "immediate"},
+    {VK_PRESENT_MODE_MAILBOX_KHR, "mailbox"},
+    {VK_PRESENT_MODE_FIFO_KHR, "fifo"},
+    {VK_PRESENT_MODE_FIFO_RELAXED_KHR, "fifo-relaxed"},
+};
+const int numPresentModes = sizeof(PresentModes) / sizeof(struct presentmode);
+
+std::string PresentModeName(VkPresentModeKHR mode) {
+    for (int i = 0; i < numPresentModes; i++) {
+        if (PresentModes[i].mode == mode) {
+            return PresentModes[i].name;
+        }
+    }
+    return "unknown";
+}
+
+bool ParsePresentMode(const std::string &name, VkPresentModeKHR &mode) {
+    for (int i = 0; i < numPresentModes; i++) {
+        if (PresentModes[i].name == name) {
+            mode = PresentModes[i].mode;
+            return true;
+        }
+    }
+    return false;
+}
+
 class BaseProject;
 
+// Coarser levels of detail are appended to the index buffer of a model
+struct MeshLod {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+};
+
+// Collision footprint of a mesh on the xz plane: an 8-DOP, the vertices
+// bounded along x, z, x + z and x - z. It is a convex octagon enclosing the
+// mesh, and it always has 8 corners and 4 edge directions, so testing two of
+// them has the same cost whatever the meshes.
+struct WorldFootprint {
+    float x[8]; // corners, counterclockwise
+    float z[8];
+    float axisX[4]; // edge normals
+    float axisZ[4];
+    float low[4]; // projection of the corners on the normals
+    float high[4];
+};
+
+struct Footprint {
+    glm::vec4 min; // x, z, x + z, x - z
+    glm::vec4 max;
+
+    void compute(const std::vector<Vertex> &vertices);
+    // Rotated by angle around y, translated by offset, then scaled, in the
+    // same order as the model matrices of the game
+    void place(float scale, float angle, glm::vec2 offset, WorldFootprint &world) const;
+    // Largest distance of a corner from the origin of the mesh
+    float reach() const;
+};
+
+// Separating axis test: the axes are the 4 edge normals of each footprint,
+// the corners of the other one are projected on 4 axes at a time
+bool FootprintsOverlap(const WorldFootprint &a, const WorldFootprint &b);
+// The same test, continuous: b moves by motion, relative to a, along the
+// step. On each axis the projections meet during an interval of the step,
+// they collide if all the intervals share a time: time is the first one,
+// from 0 (start of the step) to 1.
+bool FootprintsSweep(const WorldFootprint &a, const WorldFootprint &b, glm::vec2 motion, float &time);
+
 struct Model {
     BaseProject *BP;
     std::vector<Vertex> vertices;
@@ -268,12 +372,29 @@ struct Model {
     VkDeviceMemory vertexBufferMemory;
     VkBuffer indexBuffer;
     VkDeviceMemory indexBufferMemory;
+    // Index ranges of the levels of detail, lods[0] is the full mesh
+    std::vector<MeshLod> lods;
+    // Object space bounds, computed at load time
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+    glm::vec3 boundCenter;
+    float boundRadius;
+    Footprint footprint;
 
     void loadModel(std::string file);
+    void computeBounds();
+    void buildLods(int levels);
     void createIndexBuffer();
     void createVertexBuffer();
 
-    void init(BaseProject *bp, std::string file);
+    // Bounding sphere (center, radius) in world space
+    glm::vec4 worldBoundingSphere(const glm::mat4 &modelMatrix) const;
+
+    // load() only works on the CPU, several models can be loaded at once on
+    // different threads; upload() creates the buffers
+    void load(std::string file, int lodLevels = 1);
+    void upload(BaseProject *bp);
+    void init(BaseProject *bp, std::string file, int lodLevels = 1);
     void cleanup();
 };
 
@@ -319,8 +440,49 @@ struct Pipeline {
     void cleanup();
 };
 
+// Compute shader with its layout, dispatched outside of the render pass
+struct ComputePipeline {
+    BaseProject *BP;
+    VkPipeline computePipeline;
+    VkPipelineLayout pipelineLayout;
+
+    void init(BaseProject *bp, const std::string &ComputeShader,
+              std::vector<DescriptorSetLayout *> D, uint32_t pushConstantSize = 0);
+    void cleanup();
+};
+
+// Hierarchical depth buffer: every texel of level i holds the farthest depth
+// of the texels it covers in level i - 1, level 0 being a conservative
+// power of two reduction of the depth attachment. It is rebuilt every frame
+// after the first render pass and sampled by the occlusion culling shaders.
+struct DepthPyramid {
+    BaseProject *BP;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    VkImage image;
+    VkDeviceMemory imageMemory;
+    std::vector<VkImageView> levelViews;
+    // View of all the levels with a nearest sampler, to be bound with a
+    // TEXTURE DescriptorSetElement
+    Texture texture;
+    bool built = false;
+
+    DescriptorSetLayout DSL;
+    VkDescriptorPool descriptorPool;
+    std::vector<VkDescriptorSet> descriptorSets;  // one per level
+    ComputePipeline reducePipeline;
+
+    void init(BaseProject *bp);
+    void record(VkCommandBuffer commandBuffer);
+    void cleanup();
+};
+
+// STORAGE buffers are host visible and can also be used as indirect draw
+// arguments or cleared with vkCmdFillBuffer
 enum DescriptorSetElementType { UNIFORM,
-                                TEXTURE };
+                                TEXTURE,
+                                STORAGE };
 
 struct DescriptorSetElement {
     int binding;
@@ -361,9 +523,815 @@ struct DescriptorSet {
 
     void init(BaseProject *bp, DescriptorSetLayout *L,
               std::vector<DescriptorSetElement> E);
+    // Points a texture binding of every set to a new texture
+    void writeTexture(int binding, Texture *tex);
     void cleanup();
 };
 
+// View frustum culling
+// Planes are extracted from the view-projection matrix, pointing inwards
+// (left, right, bottom, top, near, far). Spheres are tested four at a time.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    static Frustum fromMatrix(const glm::mat4 &viewProj);
+    // Appends to visible the indices of the spheres (center, radius)
+    // intersecting the frustum
+    void cull(const std::vector<glm::vec4> &spheres, std::vector<uint32_t> &visible) const;
+};
+
+// Transform system
+// Objects are kept as translation, rotation and scale (TRS) components, in a
+// structure of arrays. Changing a component marks the object dirty, and
+// update() rebuilds the model matrices of the dirty objects only, four at a
+// time with SSE. A rebuilt matrix is then stale in every frame in flight,
+// until it has been uploaded to the buffers of that frame.
+struct TransformSystem {
+    std::vector<float> tx, ty, tz;
+    std::vector<float> qx, qy, qz, qw;
+    std::vector<float> sx, sy, sz;
+    std::vector<glm::mat4> matrices;
+    std::vector<uint8_t> dirty;
+    std::vector<uint8_t> stale;  // one bit per frame in flight
+    uint8_t allFrames = 1;
+
+    void init(size_t count, int framesInFlight);
+    size_t size() const {
+        return matrices.size();
+    }
+
+    void setTranslation(size_t i, glm::vec3 t);
+    void setRotation(size_t i, glm::quat q);
+    void setScale(size_t i, glm::vec3 s);
+
+    // Composes the dirty matrices, returns how many there were. Ranges
+    // starting at a multiple of 4 can be updated in parallel
+    size_t update();
+    size_t update(size_t begin, size_t end);
+    // Whether the matrix of object i has to be uploaded for frame: it is
+    // considered uploaded afterwards
+    bool takeStale(size_t i, uint32_t frame);
+
+    static glm::mat4 compose(glm::vec3 t, glm::quat q, glm::vec3 s);
+
+   private:
+    void composeScalar(size_t i);
+#if HAS_SSE
+    void composeSSE(size_t first);
+#endif
+};
+
+// Entity component storage
+// An entity is only an id. Entities with the same set of components share an
+// archetype, which stores them in chunks of 16 KiB: in each chunk the ids
+// come first, then one array per component. each<A, B...>() hands a system
+// the arrays of every chunk whose archetype has (at least) A, B..., so it
+// walks contiguous memory whatever the other components of the entities.
+// Components are plain data, up to 64 types: they are copied bytewise when an
+// entity moves to another archetype (add, remove) and when destroy() fills
+// its row with the last entity of the archetype.
+struct Entity {
+    uint32_t index = 0;
+    uint32_t generation = 0;  // never 0 for a live entity, Entity{} is null
+
+    bool operator==(const Entity &other) const {
+        return index == other.index && generation == other.generation;
+    }
+    bool operator!=(const Entity &other) const {
+        return !(*this == other);
+    }
+};
+
+typedef uint64_t ComponentMask;  // bit i for the component type i
+
+struct ComponentType {
+    size_t size;
+    size_t align;
+};
+
+struct EntityChunk {
+    static const size_t Size = 16384;
+    alignas(64) unsigned char bytes[Size];
+};
+
+struct Archetype {
+    ComponentMask mask = 0;
+    std::array<int8_t, 64> column;  // of each component type, -1 if absent
+    std::vector<int> types;         // component types, by column
+    std::vector<size_t> offsets;    // of each column in a chunk
+    std::vector<size_t> sizes;      // of a component of each column
+    size_t capacity = 0;            // entities per chunk
+    size_t count = 0;
+    std::vector<std::unique_ptr<EntityChunk>> chunks;
+
+    Entity *entities(size_t chunk) {
+        return reinterpret_cast<Entity *>(chunks[chunk]->bytes);
+    }
+    // Component of column c of the row-th entity
+    void *component(size_t row, int c) {
+        return chunks[row / capacity]->bytes + offsets[c] + row % capacity * sizes[c];
+    }
+};
+
+class EntityWorld {
+   public:
+    template <typename T>
+    static int componentId() {
+        static_assert(std::is_trivially_copyable<T>::value, "components are copied bytewise");
+        static_assert(alignof(T) <= alignof(EntityChunk), "component alignment is above the chunk's");
+        static const int id = registerComponent(sizeof(T), alignof(T));
+        return id;
+    }
+    template <typename... C>
+    static ComponentMask maskOf() {
+        ComponentMask mask = 0;
+        for (int id : {componentId<C>()...}) {
+            mask |= ComponentMask(1) << id;
+        }
+        return mask;
+    }
+    static std::vector<ComponentType> &componentTypes();
+
+    template <typename... C>
+    Entity create(const C &...components) {
+        Entity e = allocate();
+        Archetype &a = archetype(maskOf<C...>());
+        if (a.types.size() != sizeof...(C)) {
+            throw std::runtime_error("entity created with the same component twice");
+        }
+        size_t row = append(a, e);
+        int ids[] = {componentId<C>()...};
+        const void *values[] = {&components...};
+        for (size_t i = 0; i < sizeof...(C); i++) {
+            int c = a.column[ids[i]];
+            memcpy(a.component(row, c), values[i], a.sizes[c]);
+        }
+        return e;
+    }
+    void destroy(Entity e);
+    bool alive(Entity e) const;
+    size_t size() const {
+        return live;
+    }
+    // Destroys every entity, the chunks are kept for the next ones
+    void clear();
+
+    template <typename T>
+    bool has(Entity e) const {
+        return (location(e).archetype->mask >> componentId<T>()) & 1;
+    }
+    template <typename T>
+    T &get(Entity e) {
+        const Location &l = location(e);
+        int c = l.archetype->column[componentId<T>()];
+        if (c < 0) {
+            throw std::runtime_error("entity has no such component");
+        }
+        return *static_cast<T *>(l.archetype->component(l.row, c));
+    }
+    // Adding a component the entity has overwrites it
+    template <typename T>
+    void add(Entity e, const T &component) {
+        int id = componentId<T>();
+        if (!has<T>(e)) {
+            move(e, location(e).archetype->mask | ComponentMask(1) << id);
+        }
+        get<T>(e) = component;
+    }
+    template <typename T>
+    void remove(Entity e) {
+        if (has<T>(e)) {
+            move(e, location(e).archetype->mask & ~(ComponentMask(1) << componentId<T>()));
+        }
+    }
+
+    // Calls system(count, entities, a, b...) on every chunk with components
+    // C..., a and b being the arrays of the first two of them. Entities must
+    // not be created, destroyed, or change components meanwhile
+    template <typename... C, typename F>
+    void each(F &&system) {
+        ComponentMask mask = maskOf<C...>();
+        for (const auto &a : archetypes) {
+            if ((a->mask & mask) != mask) {
+                continue;
+            }
+            for (size_t chunk = 0; chunk * a->capacity < a->count; chunk++) {
+                size_t count = std::min(a->capacity, a->count - chunk * a->capacity);
+                unsigned char *bytes = a->chunks[chunk]->bytes;
+                system(count, a->entities(chunk),
+                       reinterpret_cast<C *>(bytes + a->offsets[a->column[componentId<C>()]])...);
+            }
+        }
+    }
+
+   private:
+    struct Location {
+        Archetype *archetype = nullptr;  // null if the index is free
+        size_t row = 0;
+        uint32_t generation = 0;
+    };
+
+    std::vector<Location> locations;  // by entity index
+    std::vector<uint32_t> freeIndices;
+    std::vector<std::unique_ptr<Archetype>> archetypes;
+    std::unordered_map<ComponentMask, Archetype *> byMask;
+    size_t live = 0;
+
+    static int registerComponent(size_t size, size_t align);
+    const Location &location(Entity e) const;
+    Entity allocate();
+    Archetype &archetype(ComponentMask mask);
+    size_t append(Archetype &a, Entity e);
+    void removeRow(Archetype &a, size_t row);
+    void move(Entity e, ComponentMask mask);
+};
+
+// Heap allocation counter
+// With COUNT_ALLOCATIONS=1 (make debug) the global operator new counts the
+// allocations made through it, by any thread. The C allocator and the Vulkan
+// driver are not seen. The frame loop is expected to leave the heap alone
+// once warmed up, see BaseProject::setAllocationCheck. Off by default: the
+// counter is a shared atomic touched by every allocation.
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif
+
+static std::atomic<uint64_t> heapAllocations{0};
+
+#if COUNT_ALLOCATIONS
+// The array and nothrow forms call these
+void *operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size > 0 ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = static_cast<size_t>(align);
+    // aligned_alloc wants a multiple of the alignment
+    if (void *p = std::aligned_alloc(alignment, std::max(alignment, (size + alignment - 1) / alignment * alignment))) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+#endif
+
+// Frame arena
+// Temporary data of a frame is bump-allocated from one block and dropped all
+// at once by reset(), at the start of the next frame. What does not fit gets
+// a block of its own from the heap, until the next reset() replaces the
+// block with a larger one: after the first frames the arena stops
+// allocating. Nothing is destroyed, so it only holds trivially destructible
+// data, and it belongs to one thread.
+struct FrameArena {
+    void *allocate(size_t bytes, size_t align);
+    template <typename T>
+    T *allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "frame arena data is never destroyed");
+        return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+    }
+    void reset();
+    size_t capacity() const {
+        return size;
+    }
+
+   private:
+    std::unique_ptr<unsigned char[]> block;
+    size_t size = 0;
+    size_t offset = 0;
+    std::vector<std::unique_ptr<unsigned char[]>> overflow;  // this frame only
+    size_t overflowBytes = 0;
+};
+
+// Render queue
+// Every frame the application submits its draws with a 64-bit sort key:
+//   bits 62-63 pass, 54-61 pipeline, 42-53 material, 32-41 mesh, 8-31 depth
+// The queue is radix-sorted and replayed skipping redundant binds, so state
+// changes are grouped and, inside a group, objects are drawn front to back.
+// Passes from PASS_LATE on are drawn in a second render pass, after the depth
+// pyramid has been built from the depth of the first one.
+enum RenderPassOrder { PASS_OPAQUE = 0,
+                       PASS_LATE = 1,
+                       PASS_BACKGROUND = 2 };
+
+struct DrawCommand {
+    uint64_t key;
+    Pipeline *pipeline;
+    uint32_t setCount;
+    VkDescriptorSet sets[3];  // bound starting from set 0
+    VkBuffer vertexBuffer;
+    VkBuffer indexBuffer;
+    uint32_t indexCount;
+    // When set, the draws are read from VkDrawIndexedIndirectCommands written
+    // on the GPU, at most maxDrawCount of them, the actual number at countOffset
+    VkBuffer indirectBuffer;
+    VkDeviceSize indirectOffset;
+    VkBuffer countBuffer;
+    VkDeviceSize countOffset;
+    uint32_t maxDrawCount;
+};
+
+struct RenderQueueStats {
+    uint32_t pipelineBinds = 0;
+    uint32_t descriptorSetBinds = 0;
+    uint32_t bufferBinds = 0;
+    uint32_t draws = 0;
+
+    void add(const RenderQueueStats &other);
+};
+
+struct RenderQueue {
+    // Device capabilities for indirect draws, set once the device is created
+    bool drawIndirectCount = false;
+    bool multiDrawIndirect = false;
+
+    std::vector<DrawCommand> commands;
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> order;  // indices into commands, in draw order after sort()
+
+    static uint64_t makeKey(uint32_t pass, uint32_t pipeline, uint32_t material,
+                            uint32_t mesh, uint32_t depth);
+    static uint32_t quantizeDepth(float viewDepth, float nearPlane, float farPlane);
+
+    void clear();
+    void submit(const DrawCommand &command);
+    // The radix passes ping-pong with buffers of the arena
+    void sort(FrameArena &arena);
+    size_t size() const { return commands.size(); }
+    // First position, in sorted order, of the draws of the given pass or later
+    size_t passBegin(uint32_t pass) const;
+    void replay(VkCommandBuffer commandBuffer, size_t begin, size_t end,
+                RenderQueueStats &stats) const;
+};
+
+// Lesson 22.5 --- Per-frame recording
+// Each slice of the render queue is recorded by a job, with one transient pool
+// (and one secondary command buffer) per frame in flight: a slice is only
+// recorded by one job at a time, so pools can be reset without locking.
+struct RecordingSlice {
+    std::vector<VkCommandPool> commandPools;
+    std::vector<VkCommandBuffer> commandBuffers;
+    double lastRecordingTime = 0.0;   // ms, last frame
+    double totalRecordingTime = 0.0;  // ms, whole session
+    RenderQueueStats queueStats;      // binds and draws of its slice, last frame
+};
+
+// Lock-free ring buffer between exactly one producer and one consumer thread.
+// One slot is always left empty, to tell a full queue from an empty one.
+template <typename T, size_t Capacity>
+struct SpscQueue {
+    std::array<T, Capacity> items;
+    alignas(64) std::atomic<size_t> head{0};  // next slot to pop, owned by the consumer
+    alignas(64) std::atomic<size_t> tail{0};  // next slot to push, owned by the producer
+
+    bool push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % Capacity;
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        items[t] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[h];
+        head.store((h + 1) % Capacity, std::memory_order_release);
+        return true;
+    }
+};
+
+// Fixed ring buffer owned by a single thread. push fails when it is full
+// instead of allocating, the caller decides what to drop.
+template <typename T, size_t Capacity>
+struct RingBuffer {
+    std::array<T, Capacity> items;
+    size_t head = 0;  // oldest item
+    size_t count = 0;
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    bool push(const T &item) {
+        if (count == Capacity) {
+            return false;
+        }
+        items[(head + count) % Capacity] = item;
+        count++;
+        return true;
+    }
+
+    T &front() {
+        return items[head];
+    }
+
+    void pop() {
+        head = (head + 1) % Capacity;
+        count--;
+    }
+
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+};
+
+// Lock-free triple buffer: the producer always has a free slot to write and
+// the consumer always gets the latest complete one, so neither ever waits.
+template <typename T>
+struct TripleBuffer {
+    static const uint32_t NEW_BIT = 4;
+
+    std::array<T, 3> slots;
+    // slot published last, with NEW_BIT set until the consumer takes it
+    std::atomic<uint32_t> ready{0};
+    uint32_t back = 1;   // producer only
+    uint32_t front = 2;  // consumer only
+
+    T &writeSlot() {
+        return slots[back];
+    }
+
+    void publish() {
+        back = ready.exchange(back | NEW_BIT, std::memory_order_acq_rel) & ~NEW_BIT;
+    }
+
+    // The latest published value, or the one of the previous call if there is
+    // nothing new (a default constructed T before the first publish)
+    const T &read() {
+        if (ready.load(std::memory_order_relaxed) & NEW_BIT) {
+            front = ready.exchange(front, std::memory_order_acq_rel) & ~NEW_BIT;
+        }
+        return slots[front];
+    }
+};
+
+// Random numbers
+// xoshiro256** (Blackman and Vigna): 256 bits of state, a period of 2^256 - 1,
+// a few shifts and xors per number. A generator belongs to one thread: every
+// subsystem and thread takes its own stream, see stream(). Runs can be
+// replayed from their seed, whatever the CPU.
+struct Random {
+    uint64_t s[4];
+
+    // The state is expanded from seed with splitmix64
+    explicit Random(uint64_t seed = 0);
+
+    uint64_t next();
+    // Uniform in [low, high), with 24 bits of randomness
+    float uniform(float low = 0.0f, float high = 1.0f);
+    // Uniform in [0, n)
+    uint32_t below(uint32_t n);
+    // Skips 2^128 numbers
+    void jump();
+
+    // Stream n of seed: n jumps after the seed, so streams never overlap
+    static Random stream(uint64_t seed, uint32_t n);
+};
+
+// Four xoshiro256** generators side by side, each one jumped once from the
+// previous one, drawn together four numbers at a time: with SSE2 each stream
+// is a 64-bit lane. The numbers do not depend on the path taken.
+struct RandomBatch {
+    alignas(16) uint64_t s[4][4];  // [word][stream]
+
+    RandomBatch() : RandomBatch(Random()) {
+    }
+    explicit RandomBatch(Random random);
+
+    // count numbers uniform in [low, high), four at a time: the ones left
+    // over from the last four are dropped
+    void fill(float *out, size_t count, float low, float high);
+
+   private:
+#if HAS_SSE
+    void fillSSE(float *out, size_t groups, float low, float high);
+#endif
+    void fillScalar(float *out, size_t groups, float low, float high);
+};
+
+// Job system
+// A job runs a function on a range [begin, end) of some data. Each worker
+// thread owns a Chase-Lev deque: it pushes and pops its own jobs at the
+// bottom, while idle workers steal from the top. Other threads (main, render,
+// simulation) submit to a shared queue, and run jobs while they wait for
+// theirs. Jobs are not allocated: their memory belongs to the caller, who
+// keeps it until the counter of the job has been waited on.
+struct JobCounter;
+
+struct Job {
+    void (*function)(void *data, size_t begin, size_t end);
+    void *data;
+    size_t begin;
+    size_t end;
+    JobCounter *counter;
+};
+
+// Unfinished jobs of a batch. Jobs scheduled after a counter only start once
+// it gets to zero.
+struct JobCounter {
+    std::atomic<int> pending{0};
+    std::mutex mutex;
+    std::vector<Job *> waiting;  // jobs depending on this counter
+    std::exception_ptr error;    // first exception thrown by its jobs
+};
+
+struct WorkStealingDeque {
+    static const int64_t Capacity = 4096;  // power of two
+
+    std::array<std::atomic<Job *>, Capacity> items;
+    alignas(64) std::atomic<int64_t> top{0};     // stolen from here
+    alignas(64) std::atomic<int64_t> bottom{0};  // owner only
+
+    bool push(Job *job);  // false if full
+    Job *pop();
+    Job *steal();
+};
+
+struct JobWorker {
+    std::thread thread;
+    WorkStealingDeque deque;
+    std::atomic<uint64_t> busyTime{0};  // ns spent running jobs
+    std::atomic<uint64_t> jobsRun{0};
+    std::atomic<uint64_t> jobsStolen{0};
+};
+
+struct JobSystem {
+    static const size_t maxChunks = 64;  // jobs of a parallelFor
+
+    std::vector<std::unique_ptr<JobWorker>> workers;
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<uint64_t> helperJobs{0};  // run by threads waiting for them
+
+    // count workers, 0 for one per core but one (the thread submitting the
+    // jobs helps while it waits)
+    void start(int count = 0);
+    void stop();
+    ~JobSystem() {
+        stop();
+    }
+
+    // Runs job, counted by counter, after dependency (if any) is done
+    void schedule(Job &job, JobCounter &counter, JobCounter *dependency = nullptr);
+    // Runs jobs until counter is done, then rethrows the first exception of
+    // its jobs
+    void wait(JobCounter &counter);
+    // True once the jobs of counter are all done, wait() then returns at once
+    bool done(const JobCounter &counter) const {
+        return counter.pending.load() == 0;
+    }
+
+    // Calls body(begin, end) on chunks of [0, count) of at least grain
+    // items, in parallel, and returns when they are all done
+    template <typename F>
+    void parallelFor(size_t count, size_t grain, const F &body) {
+        size_t chunks = std::min(maxChunks, (count + grain - 1) / std::max<size_t>(grain, 1));
+        if (chunks <= 1 || workers.empty()) {
+            if (count > 0) {
+                body(size_t(0), count);
+            }
+            return;
+        }
+        std::array<Job, maxChunks> jobs;
+        JobCounter counter;
+        for (size_t c = 0; c < chunks; c++) {
+            Job &job = jobs[c];
+            job.function = [](void *data, size_t begin, size_t end) {
+                (*static_cast<const F *>(data))(begin, end);
+            };
+            job.data = const_cast<F *>(&body);
+            job.begin = count * c / chunks;
+            job.end = count * (c + 1) / chunks;
+            schedule(job, counter);
+        }
+        wait(counter);
+    }
+
+    // Share of the time the workers spent running jobs since start()
+    double utilization() const;
+    uint64_t jobsRun() const;
+    uint64_t jobsStolen() const;
+
+   private:
+    static thread_local int workerIndex;  // -1 outside of the workers
+
+    std::mutex sharedMutex;
+    // ring of sharedCount jobs from sharedHead: unlike a std::deque, it stops
+    // allocating once it is large enough
+    std::vector<Job *> shared;
+    size_t sharedHead = 0;
+    size_t sharedCount = 0;
+    std::atomic<int> queued{0};  // jobs waiting in the deques and in shared
+    std::atomic<int> sleeping{0};
+    std::atomic<bool> quit{false};
+    std::mutex sleepMutex;
+    std::condition_variable wakeCondition;
+
+    void submit(Job *job);
+    Job *findJob();
+    void execute(Job *job);
+    void finish(JobCounter &counter);
+    void workerLoop(int index);
+};
+
+thread_local int JobSystem::workerIndex = -1;
+
+// Starts the frames at a fixed rate. A sleep may end a millisecond or more
+// late, so the thread sleeps until spinMargin before the frame start and
+// yields in a loop for the rest. In idle mode the wait can be cut short by
+// wake(), e.g. on input, and a rate of 0 waits for it (at most maxIdleWait).
+struct FramePacer {
+    std::chrono::duration<double> spinMargin{0.002};
+    std::chrono::duration<double> maxIdleWait{1.0};
+    std::chrono::steady_clock::time_point frameStart{};
+    double lastJitter = 0.0;  // seconds the frame started after its time
+
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    bool woken = false;
+
+    // Returns the seconds waited; rate is in frames per second, 0 is
+    // unlimited (or wait for wake() if idle)
+    double wait(double rate, bool idle) {
+        using clock = std::chrono::steady_clock;
+        auto now = clock::now();
+        if (rate <= 0.0 && !idle) {
+            frameStart = now;
+            lastJitter = 0.0;
+            return 0.0;
+        }
+
+        auto period = rate > 0.0 ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / rate))
+                                 : std::chrono::duration_cast<clock::duration>(maxIdleWait);
+        frameStart += period;
+        // after a stall, or if the rate has changed, the frames restart from now
+        if (frameStart < now - period || frameStart > now + period) {
+            frameStart = now;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!idle) {
+            woken = false;
+        }
+        if (wakeCondition.wait_until(lock, frameStart - spinMargin, [&] { return idle && woken; })) {
+            woken = false;
+            frameStart = clock::now();
+        }
+        lock.unlock();
+        while (clock::now() < frameStart) {
+            std::this_thread::yield();
+        }
+
+        auto end = clock::now();
+        lastJitter = std::chrono::duration<double>(end - frameStart).count();
+        return std::chrono::duration<double>(end - now).count();
+    }
+
+    void wake() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            woken = true;
+        }
+        wakeCondition.notify_one();
+    }
+};
+
+// Window events, sent by the main thread to the render and simulation threads
+enum InputEventType { INPUT_KEY,
+                      INPUT_RESIZE };
+
+struct InputEvent {
+    InputEventType type;
+    int key;     // INPUT_KEY
+    int action;  // GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+    int width;   // INPUT_RESIZE, framebuffer size
+    int height;
+    double time;  // steadyTime() when the event was received
+    uint64_t id;  // INPUT_KEY, numbered from 1 by the main thread
+};
+
+// A key press on its way to the screen: the simulation stamps the last one
+// it applied, the game hands it back to the renderer with its snapshot
+struct InputStamp {
+    uint64_t id = 0;        // 0: no input
+    double received = 0.0;  // steadyTime() in the key callback
+    double applied = 0.0;   // steadyTime() at the tick that applied it
+};
+
+// Input-to-photon latency of a press, taken by the first frame that shows it.
+// All the times are steadyTime() seconds.
+struct LatencySample {
+    InputStamp input;
+    double latched = 0.0;    // written in the uniforms of the frame
+    double submitted = 0.0;  // vkQueueSubmit returned
+    double presented = 0.0;  // vkQueuePresentKHR returned
+    double completed = 0.0;  // on screen, or at least rendered
+    uint64_t presentId = 0;
+    uint64_t timelineValue = 0;
+    uint32_t frameSlot = 0;
+};
+
+// Events travelling from the main thread to one consumer thread. If the
+// consumer falls behind they wait in pending, only once that is full too are
+// new events dropped
+struct InputChannel {
+    SpscQueue<InputEvent, 1024> queue;
+    RingBuffer<InputEvent, 256> pending;  // main thread only
+    uint64_t dropped = 0;                 // main thread only
+
+    void post(const InputEvent &event) {
+        flush();
+        if (!pending.push(event)) {
+            dropped++;
+        }
+        flush();
+    }
+
+    void flush() {
+        while (!pending.empty() && queue.push(pending.front())) {
+            pending.pop();
+        }
+    }
+};
+
+// Sent back by the render thread after every presented frame
+struct FramePacket {
+    uint64_t frame;
+    double frameTime;  // ms since the previous frame
+    uint32_t gpuLag;
+    float resolutionScale;
+};
+
+// Destruction of a resource the GPU may still be using, run once the
+// timeline semaphore reaches timelineValue
+struct DeferredDeletion {
+    uint64_t timelineValue;
+    std::function<void()> destroy;
+};
+
+// Statistics collected by drawFrame, printed at cleanup
+struct FrameStats {
+    uint64_t frames = 0;
+    uint32_t lastVisible = 0;  // objects that passed frustum culling, last frame
+    uint32_t lastCulled = 0;
+    uint64_t totalVisible = 0;
+    uint64_t totalCulled = 0;
+    RenderQueueStats lastQueueStats;   // last frame
+    RenderQueueStats totalQueueStats;  // whole session
+    double lastPrimaryRecordingTime = 0.0;   // ms, includes waiting for the workers
+    double totalPrimaryRecordingTime = 0.0;  // ms
+    uint64_t totalGpuLag = 0;  // frames the GPU was still busy with, at every frame start
+    std::vector<LatencySample> latency;  // one per press that reached the screen
+    uint64_t droppedLatency = 0;         // presses shown but not measured, too many pending
+    // frame pacing and power
+    uint64_t idleFrames = 0;
+    double sessionStart = 0.0;  // steadyTime()
+    double sessionEnd = 0.0;
+    clock_t cpuStart = 0;  // clock() at the start and the end of the session
+    clock_t cpuEnd = 0;
+    double pacingWait = 0.0;    // s the render thread slept or spun before its frames
+    double totalJitter = 0.0;   // s the frames started late, paced frames only
+    double maxJitter = 0.0;
+    uint64_t pacedFrames = 0;
+    // dynamic resolution
+    double lastGpuTime = 0.0;  // s, from the timestamps of the frame
+    double totalGpuTime = 0.0;
+    uint64_t gpuTimedFrames = 0;
+    double totalResolutionScale = 0.0;
+    float minResolutionScale = 1.0f;
+    // heap allocations of all threads between two frames, once warmed up
+    uint64_t allocationFrames = 0;  // frames counted
+    uint64_t lastAllocations = 0;
+    uint64_t totalAllocations = 0;
+    uint64_t maxAllocations = 0;
+    uint64_t allocatingFrames = 0;  // with at least one allocation
+};
+
 // MAIN !
 class BaseProject {
     friend class Model;
@@ -371,10 +1339,13 @@ class BaseProject {
     friend class Pipeline;
     friend class DescriptorSetLayout;
     friend class DescriptorSet;
+    friend class ComputePipeline;
+    friend class DepthPyramid;
 
    public:
     virtual void setWindowParameters() = 0;
     void run() {
+        std::cout << "Random seed: " << randomSeed << std::endl;
         setWindowParameters();
         initWindow();
         initVulkan();
@@ -382,8 +1353,73 @@ class BaseProject {
         cleanup();
     }
 
+    // Must be called before run(): uniform buffers, descriptor sets, command
+    // buffers and sync objects are all allocated once per frame in flight
+    void setFramesInFlight(int count) {
+        framesInFlight = std::max(MIN_FRAMES_IN_FLIGHT, std::min(count, MAX_FRAMES_IN_FLIGHT));
+    }
+
+    // Falls back to FIFO if the surface does not support the requested mode.
+    // Can also be changed while running with F10.
+    void setPresentMode(VkPresentModeKHR mode) {
+        requestedPresentMode = mode;
+    }
+
+    // Frames per second while playing, 0 (default) is as fast as the present
+    // mode allows
+    void setFrameRateLimit(double rate) {
+        targetFrameRate = std::max(0.0, rate);
+    }
+
+    // GPU time the scene of a frame should take, in ms, the blit to the swap
+    // chain and the wait for its image left out: the rendering resolution goes
+    // down to minScale (0.5 by default) of the window to stay within it, and
+    // back up when there is room. 0 keeps the full resolution.
+    void setGpuTimeBudget(double milliseconds, float minScale = 0.5f) {
+        gpuTimeBudget = std::max(0.0, milliseconds) / 1000.0;
+        minResolutionScale = std::max(0.1f, std::min(minScale, 1.0f));
+    }
+
+    // Frames per second when there is nothing new to show (see isIdle()) or
+    // the window is not focused, 0 only draws on input
+    void setIdleFrameRate(double rate) {
+        idleFrameRate = std::max(0.0, rate);
+    }
+
+    // Allocation check: from warmup frames on, the heap allocations between
+    // two frames are counted (see heapAllocations), and the window is closed
+    // after frames of them. allocationCheckPassed() then tells whether the
+    // frame loop stayed off the heap. Only with COUNT_ALLOCATIONS (make debug).
+    void setAllocationCheck(uint64_t frames, uint64_t warmup = 300) {
+        allocationCheckFrames = frames;
+        allocationWarmupFrames = warmup;
+    }
+
+    bool allocationCheckPassed() const {
+        return COUNT_ALLOCATIONS && stats.allocationFrames > 0 && stats.totalAllocations == 0;
+    }
+
+    // Worker threads of the job system, 0 (default) for one per core but
+    // one, must be called before run()
+    void setJobWorkers(int count) {
+        jobWorkerCount = std::max(0, count);
+    }
+
+    // Ticks per second of the simulation (default 120), must be called
+    // before run()
+    void setSimulationRate(double rate) {
+        simulationRate = std::max(1.0, rate);
+    }
+
+    // Seed of the random streams, must be called before run(). By default
+    // it comes from the clock: run() prints it, for the run to be replayed
+    void setRandomSeed(uint64_t seed) {
+        randomSeed = seed;
+    }
+
     // FIXME PROTECTED
     std::vector<VkImage> swapChainImages;
+    int framesInFlight = 2;
     VkDescriptorPool descriptorPool;
     VkDevice device;
     // Lesson 21
@@ -429,6 +1465,7 @@ class BaseProject {
     VkClearColorValue initialBackgroundColor;
     int uniformBlocksInPool;
     int texturesInPool;
+    int storageBlocksInPool = 0;
     int setsInPool;
 
     VkResult result;
@@ -440,21 +1477,124 @@ class BaseProject {
     // Lesson 13
     VkSurfaceKHR surface;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    // Vulkan 1.2 drawIndirectCount, otherwise indirect draws use maxDrawCount
+    // zero-filled commands
+    bool drawIndirectCountSupported = false;
+    bool multiDrawIndirectSupported = false;
     //    VkDevice device;
     VkQueue graphicsQueue;
     VkQueue presentQueue;
     VkCommandPool commandPool;
+    // Lesson 22.5 --- one transient pool and primary buffer per frame in flight
+    std::vector<VkCommandPool> frameCommandPools;
     std::vector<VkCommandBuffer> commandBuffers;
 
+    // Draws of the current frame, sorted before recording: the ones before
+    // renderQueueSplit go in the first render pass
+    RenderQueue renderQueue;
+    size_t renderQueueSplit = 0;
+    // Temporary data of the frame being prepared, render thread only
+    FrameArena frameArena;
+
+    // Secondary command buffers recorded in parallel every frame, by jobs:
+    // slice i replays the i-th part of the sorted render queue
+    int commandBufferSlices = 1;
+    std::vector<RecordingSlice> recordingSlices;
+    std::vector<Job> recordingJobs;
+    JobCounter recordingCounter;
+
+    // Worker threads shared by the engine and the application (asset
+    // loading, transforms, command recording)
+    JobSystem jobs;
+    int jobWorkerCount = 0;
+
+    // Every subsystem, and every thread, draws its random numbers from its
+    // own stream n of the seed
+    uint64_t randomSeed = (uint64_t)std::chrono::system_clock::now().time_since_epoch().count();
+    Random randomStream(uint32_t n) const {
+        return Random::stream(randomSeed, n);
+    }
+    // frame and swap chain image the slices are recorded for
+    size_t recordingFrame = 0;
+    uint32_t recordingImage = 0;
+
+    FrameStats stats;
+    uint64_t allocationWarmupFrames = 300;
+    uint64_t allocationCheckFrames = 0;  // 0 counts until the window is closed
+    uint64_t allocationsSeen = 0;        // heapAllocations at the end of the last frame
+
     // Lesson 14
     VkSwapchainKHR swapChain;
     // std::vector<VkImage> swapChainImages;
     VkFormat swapChainImageFormat;
     VkExtent2D swapChainExtent;
     std::vector<VkImageView> swapChainImageViews;
+    VkPresentModeKHR requestedPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    VkPresentModeKHR swapChainPresentMode;
+    // Set when the window is resized, goes fullscreen or a different present
+    // mode is requested: the swap chain is recreated after the next present
+    bool swapChainDirty = false;
+
+    // F11 toggles fullscreen, the window is restored where it was
+    bool fullscreen = false;
+    int windowedX, windowedY, windowedWidth, windowedHeight;
+
+    // The main thread only handles the window, the render thread acquires,
+    // records, submits and presents. GLFW state (keys, framebuffer size) is
+    // forwarded to it as events, since GLFW must only be used from the main thread.
+    std::thread renderThread;
+    std::atomic<bool> threadsQuit{false};
+    std::exception_ptr renderError;
+    InputChannel renderInput;
+    SpscQueue<FramePacket, 256> framePackets;
+    int framebufferWidth = 0, framebufferHeight = 0;  // render thread copy
+
+    // The game logic runs on its own thread with a fixed timestep of
+    // 1 / simulationRate seconds, and hands its state to the renderer through
+    // a TripleBuffer. After a stall at most maxSimulationSteps ticks are run
+    // at once, the rest of the lost time is dropped.
+    std::thread simulationThread;
+    std::exception_ptr simulationError;
+    double simulationRate = 120.0;
+    int maxSimulationSteps = 8;
+
+    // Render thread frame pacing, see FramePacer
+    FramePacer pacer;
+    double targetFrameRate = 0.0;
+    double idleFrameRate = 10.0;
+    std::atomic<bool> windowFocused{true};
+
+    // Key events reach the simulation with the time they were received and
+    // are applied at the tick covering that time. keysPressed keeps a press
+    // for one tick, so a tap released before the tick is not lost.
+    InputChannel simulationInput;
+    std::array<bool, GLFW_KEY_LAST + 1> keysDown{};     // simulation thread
+    std::array<bool, GLFW_KEY_LAST + 1> keysPressed{};  // since the last tick
+    InputEvent nextKeyEvent;
+    bool hasNextKeyEvent = false;
+    uint64_t inputEventCount = 0;  // main thread
+    InputStamp appliedInput;       // simulation thread, last press applied
+
+    // Input-to-photon latency. With VK_KHR_present_id and VK_KHR_present_wait
+    // a press is complete when the presentation engine shows its frame,
+    // otherwise when both the frame's last GPU timestamp and
+    // vkQueuePresentKHR are behind it.
+    bool presentWaitSupported = false;
+    PFN_vkWaitForPresentKHR waitForPresent = nullptr;
+    uint64_t presentCount = 0;  // last VkPresentIdKHR value
+    VkQueryPool timestampPool = VK_NULL_HANDLE;  // frame start and scene end, every frame in flight
+    double timestampPeriod = 0.0;  // seconds per tick
+    double gpuTimeOffset = 0.0;    // steadyTime() - ticks * timestampPeriod
+    uint64_t lastLatchedInput = 0;
+    vector<LatencySample> frameLatency;  // per frame slot, id 0 if no new press
+    RingBuffer<LatencySample, 64> pendingLatency;  // presented, waiting to be on screen
 
     // Lesson 19
+    // The first pass clears the attachments and keeps the depth for the depth
+    // pyramid, the late one loads them back for the PASS_LATE draws
     VkRenderPass renderPass;
+    VkRenderPass lateRenderPass;
+    DepthPyramid depthPyramid;
 
     // VkDescriptorPool descriptorPool;
 
@@ -468,40 +1608,177 @@ class BaseProject {
     VkImageView depthImageView;
 
     // L22.2 --- Frame buffers
-    std::vector<VkFramebuffer> swapChainFramebuffers;
+    // The scene is drawn in the top left renderExtent of an offscreen color
+    // target as big as the swap chain (like the depth buffer), then scaled
+    // into the swap chain image: changing the resolution recreates nothing
+    VkImage sceneColorImage;
+    VkDeviceMemory sceneColorImageMemory;
+    VkImageView sceneColorImageView;
+    VkFramebuffer sceneFramebuffer;
+    VkExtent2D renderExtent;
     size_t currentFrame = 0;
 
+    // Dynamic resolution, driven by the GPU time of the frames
+    float resolutionScale = 1.0f;
+    float minResolutionScale = 0.5f;
+    double gpuTimeBudget = 1.0 / 60.0;  // s, 0 keeps the full resolution
+    double smoothedGpuTime = 0.0;
+    int gpuTimeSamples = 0;  // since the last change of scale
+
     // L22.3 --- Synchronization objects
+    // Acquire and present still need binary semaphores, everything else is
+    // tracked by a single timeline semaphore on the graphics queue: every
+    // submission (frames and uploads) signals the next value of timelineValue
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
-    std::vector<VkFence> inFlightFences;
-    std::vector<VkFence> imagesInFlight;
+    VkSemaphore timelineSemaphore;
+    uint64_t timelineValue = 0;
+    uint64_t uploadTimelineValue = 0;  // the last upload, waited by the next frame
+    std::vector<uint64_t> frameTimelineValues;  // last frame submitted by each slot
+    std::deque<DeferredDeletion> deletionQueue;
 
     // Lesson 12
     void initWindow() {
         glfwInit();
 
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
         window = glfwCreateWindow(windowWidth, windowHeight, windowTitle.c_str(), nullptr, nullptr);
+        glfwSetWindowUserPointer(window, this);
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+        glfwSetKeyCallback(window, keyCallback);
+        glfwSetWindowFocusCallback(window, focusCallback);
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
     }
 
-    virtual void localInit() = 0;
+    static void framebufferResizeCallback(GLFWwindow *window, int width, int height) {
+        auto app = reinterpret_cast<BaseProject *>(glfwGetWindowUserPointer(window));
+        app->renderInput.post({INPUT_RESIZE, 0, 0, width, height, steadyTime(), 0});
+        app->pacer.wake();
+    }
 
-    // Lesson 12
-    void initVulkan() {
-        createInstance();        // L12
-        setupDebugMessenger();   // L22.0
-        createSurface();         // L13
-        pickPhysicalDevice();    // L14
-        createLogicalDevice();   // L14
+    static void focusCallback(GLFWwindow *window, int focused) {
+        auto app = reinterpret_cast<BaseProject *>(glfwGetWindowUserPointer(window));
+        app->windowFocused = focused == GLFW_TRUE;
+        app->pacer.wake();
+    }
+
+    // F11 changes the window, so it is handled here on the main thread;
+    // every other key goes to the simulation, and F10 to the render thread
+    static void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+        auto app = reinterpret_cast<BaseProject *>(glfwGetWindowUserPointer(window));
+        if (key == GLFW_KEY_F11) {
+            if (action == GLFW_PRESS) {
+                app->toggleFullscreen();
+            }
+        } else if (key == GLFW_KEY_F10) {
+            app->renderInput.post({INPUT_KEY, key, action, 0, 0, steadyTime(), 0});
+        } else if (key != GLFW_KEY_UNKNOWN && action != GLFW_REPEAT) {
+            app->simulationInput.post({INPUT_KEY, key, action, 0, 0, steadyTime(),
+                                       ++app->inputEventCount});
+        }
+        app->pacer.wake();  // an idle render thread shows the input right away
+    }
+
+    // Render thread, at the start of every frame
+    void processInput() {
+        InputEvent event;
+        while (renderInput.queue.pop(event)) {
+            if (event.type == INPUT_KEY) {
+                if (event.key == GLFW_KEY_F10 && event.action == GLFW_PRESS) {
+                    cyclePresentMode();
+                }
+            } else if (event.type == INPUT_RESIZE) {
+                framebufferWidth = event.width;
+                framebufferHeight = event.height;
+                swapChainDirty = true;
+            }
+        }
+    }
+
+    // Simulation thread, before the tick covering [tickStart, tickEnd): the
+    // events received before tickEnd are applied, the later ones wait for
+    // their own tick
+    void processSimulationInput(double tickEnd) {
+        while (hasNextKeyEvent || simulationInput.queue.pop(nextKeyEvent)) {
+            hasNextKeyEvent = true;
+            if (nextKeyEvent.time >= tickEnd) {
+                return;
+            }
+            if (nextKeyEvent.action == GLFW_PRESS) {
+                keysDown[nextKeyEvent.key] = true;
+                keysPressed[nextKeyEvent.key] = true;
+                appliedInput = {nextKeyEvent.id, nextKeyEvent.time, steadyTime()};
+            } else {
+                keysDown[nextKeyEvent.key] = false;
+            }
+            hasNextKeyEvent = false;
+        }
+    }
+
+    // Replaces glfwGetKey for the code running on the simulation thread: true
+    // if the key is held, or was pressed since the previous tick
+    bool isKeyDown(int key) {
+        return keysDown[key] || keysPressed[key];
+    }
+
+    void toggleFullscreen() {
+        if (!fullscreen) {
+            glfwGetWindowPos(window, &windowedX, &windowedY);
+            glfwGetWindowSize(window, &windowedWidth, &windowedHeight);
+            GLFWmonitor *monitor = glfwGetPrimaryMonitor();
+            const GLFWvidmode *mode = glfwGetVideoMode(monitor);
+            glfwSetWindowMonitor(window, monitor, 0, 0, mode->width, mode->height, mode->refreshRate);
+        } else {
+            glfwSetWindowMonitor(window, nullptr, windowedX, windowedY, windowedWidth, windowedHeight, 0);
+        }
+        fullscreen = !fullscreen;
+        // the size may not change (e.g. a borderless window as big as the
+        // screen), the swap chain is recreated anyway
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        renderInput.post({INPUT_RESIZE, 0, 0, width, height, steadyTime(), 0});
+    }
+
+    // Moves to the next present mode of PresentModes the surface supports
+    void cyclePresentMode() {
+        vector<VkPresentModeKHR> available = querySwapChainSupport(physicalDevice).presentModes;
+        int current = 0;
+        for (int i = 0; i < numPresentModes; i++) {
+            if (PresentModes[i].mode == swapChainPresentMode) {
+                current = i;
+            }
+        }
+        for (int step = 1; step <= numPresentModes; step++) {
+            VkPresentModeKHR mode = PresentModes[(current + step) % numPresentModes].mode;
+            if (find(available.begin(), available.end(), mode) != available.end()) {
+                requestedPresentMode = mode;
+                break;
+            }
+        }
+        swapChainDirty = true;
+    }
+
+    virtual void localInit() = 0;
+
+    // Lesson 12
+    void initVulkan() {
+        jobs.start(jobWorkerCount);
+        createInstance();        // L12
+        setupDebugMessenger();   // L22.0
+        createSurface();         // L13
+        pickPhysicalDevice();    // L14
+        createLogicalDevice();   // L14
+        createTimelineSemaphore();
         createSwapChain();       // L15
         createImageViews();      // L15
         createRenderPass();      // L19
         createCommandPool();     // L13
+        createTimestampQueries();
         createDepthResources();  // L22.1
         createFramebuffers();    // L22.2
+        depthPyramid.init(this);
 
         loadSkyBox();
 
@@ -706,8 +1983,7 @@ class BaseProject {
 
         copyBuffer(stagingBuffer, Md.vertexBuffer, bufferSize);
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        deferDestroyBuffer(uploadTimelineValue, stagingBuffer, stagingBufferMemory);
     }
 
     void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
@@ -741,8 +2017,7 @@ class BaseProject {
                      Md.indexBuffer, Md.indexBufferMemory);
 
         copyBuffer(stagingBuffer, Md.indexBuffer, bufferSize);
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        deferDestroyBuffer(uploadTimelineValue, stagingBuffer, stagingBufferMemory);
     }
 
     void createCubicTextureImage(const char *const FName[6], TextureData &TD) {
@@ -794,8 +2069,7 @@ class BaseProject {
         generateMipmaps(TD.textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                         texWidth, texHeight, TD.mipLevels, 6);
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        deferDestroyBuffer(uploadTimelineValue, stagingBuffer, stagingBufferMemory);
     }
 
     void createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage &image,
@@ -882,7 +2156,7 @@ class BaseProject {
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        appInfo.apiVersion = VK_API_VERSION_1_2;
 
         VkInstanceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -1140,8 +2414,10 @@ class BaseProject {
         VkPhysicalDeviceFeatures supportedFeatures;
         vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
 
+        // GPU driven draws start their instances at the bucket offset
         return indices.isComplete() && extensionsSupported && swapChainAdequate &&
-               supportedFeatures.samplerAnisotropy;
+               supportedFeatures.samplerAnisotropy &&
+               supportedFeatures.drawIndirectFirstInstance;
     }
 
     // Lesson 13
@@ -1243,11 +2519,69 @@ class BaseProject {
             queueCreateInfos.push_back(queueCreateInfo);
         }
 
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+        multiDrawIndirectSupported = supportedFeatures.multiDrawIndirect;
+
         VkPhysicalDeviceFeatures deviceFeatures{};
         deviceFeatures.samplerAnisotropy = VK_TRUE;
+        deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+        deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+
+        // drawIndirectCount is core, but optional, since Vulkan 1.2
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        bool vulkan12 = VK_API_VERSION_MINOR(deviceProperties.apiVersion) >= 2;
+        bool timelineSupported = false;
+        // present wait is optional, only used to measure the latency
+        bool presentWaitExtensions =
+            deviceExtensionSupported(physicalDevice, VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+            deviceExtensionSupported(physicalDevice, VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+        VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+        presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+        VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+        presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+        presentIdFeatures.pNext = &presentWaitFeatures;
+        if (vulkan12) {
+            VkPhysicalDeviceVulkan12Features supported12{};
+            supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+            if (presentWaitExtensions) {
+                supported12.pNext = &presentIdFeatures;
+            }
+            VkPhysicalDeviceFeatures2 features2{};
+            features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features2.pNext = &supported12;
+            vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+            drawIndirectCountSupported = supported12.drawIndirectCount;
+            timelineSupported = supported12.timelineSemaphore;
+            presentWaitSupported = presentWaitExtensions && presentIdFeatures.presentId &&
+                                   presentWaitFeatures.presentWait;
+        }
+        if (!timelineSupported) {
+            throw runtime_error("timeline semaphores are not supported!");
+        }
+        VkPhysicalDeviceVulkan12Features vulkan12Features{};
+        vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        vulkan12Features.drawIndirectCount = drawIndirectCountSupported;
+        vulkan12Features.timelineSemaphore = VK_TRUE;
+        renderQueue.drawIndirectCount = drawIndirectCountSupported;
+        renderQueue.multiDrawIndirect = multiDrawIndirectSupported;
+        cout << "drawIndirectCount: " << drawIndirectCountSupported
+             << ", multiDrawIndirect: " << multiDrawIndirectSupported
+             << ", presentWait: " << presentWaitSupported << "\n";
+
+        vector<const char *> extensions(deviceExtensions);
+        if (presentWaitSupported) {
+            extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+            extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+            vulkan12Features.pNext = &presentIdFeatures;
+        }
 
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        if (vulkan12) {
+            createInfo.pNext = &vulkan12Features;
+        }
 
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount =
@@ -1256,8 +2590,8 @@ class BaseProject {
         createInfo.pEnabledFeatures = &deviceFeatures;
         createInfo.pEnabledFeatures = &deviceFeatures;
         createInfo.enabledExtensionCount =
-            static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+            static_cast<uint32_t>(extensions.size());
+        createInfo.ppEnabledExtensionNames = extensions.data();
 
         createInfo.enabledLayerCount =
             static_cast<uint32_t>(validationLayers.size());
@@ -1274,10 +2608,31 @@ class BaseProject {
 
         vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
         vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+
+        if (presentWaitSupported) {
+            waitForPresent = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
+            presentWaitSupported = waitForPresent != nullptr;
+        }
+    }
+
+    bool deviceExtensionSupported(VkPhysicalDevice device, const char *name) {
+        uint32_t extensionCount;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+        vector<VkExtensionProperties> availableExtensions(extensionCount);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
+                                             availableExtensions.data());
+        for (const auto &extension : availableExtensions) {
+            if (strcmp(extension.extensionName, name) == 0) {
+                return true;
+            }
+        }
+        return false;
     }
 
     // Lesson 14
-    void createSwapChain() {
+    // When recreating, the old swap chain is handed over to the new one so
+    // the presentation engine can reuse its resources
+    void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE) {
         SwapChainSupportDetails swapChainSupport =
             querySwapChainSupport(physicalDevice);
         VkSurfaceFormatKHR surfaceFormat =
@@ -1301,7 +2656,8 @@ class BaseProject {
         createInfo.imageColorSpace = surfaceFormat.colorSpace;
         createInfo.imageExtent = extent;
         createInfo.imageArrayLayers = 1;
-        createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        // the scene is blitted in
+        createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 
         QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
         uint32_t queueFamilyIndices[] = {indices.graphicsFamily.value(),
@@ -1321,7 +2677,7 @@ class BaseProject {
         createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE;
-        createInfo.oldSwapchain = VK_NULL_HANDLE;
+        createInfo.oldSwapchain = oldSwapChain;
 
         VkResult result =
             vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain);
@@ -1330,7 +2686,8 @@ class BaseProject {
             throw runtime_error("failed to create swap chain!");
         }
         cout << "Swap chain created "
-             << "(" << swapChain << ")\n"
+             << "(" << swapChain << ", " << extent.width << "x" << extent.height
+             << ", " << PresentModeName(presentMode) << ")\n"
              << endl;
 
         vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
@@ -1340,6 +2697,7 @@ class BaseProject {
 
         swapChainImageFormat = surfaceFormat.format;
         swapChainExtent = extent;
+        swapChainPresentMode = presentMode;
     }
 
     // Lesson 14
@@ -1358,10 +2716,11 @@ class BaseProject {
     VkPresentModeKHR chooseSwapPresentMode(
         const vector<VkPresentModeKHR> &availablePresentModes) {
         for (const auto &availablePresentMode : availablePresentModes) {
-            if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+            if (availablePresentMode == requestedPresentMode) {
                 return availablePresentMode;
             }
         }
+        // FIFO is the only mode every surface has to support
         return VK_PRESENT_MODE_FIFO_KHR;
     }
 
@@ -1370,11 +2729,8 @@ class BaseProject {
         if (capabilities.currentExtent.width != UINT32_MAX) {
             return capabilities.currentExtent;
         } else {
-            int width, height;
-            glfwGetFramebufferSize(window, &width, &height);
-
-            VkExtent2D actualExtent = {static_cast<uint32_t>(width),
-                                       static_cast<uint32_t>(height)};
+            VkExtent2D actualExtent = {static_cast<uint32_t>(framebufferWidth),
+                                       static_cast<uint32_t>(framebufferHeight)};
             actualExtent.width = max(
                 capabilities.minImageExtent.width,
                 min(capabilities.maxImageExtent.width, actualExtent.width));
@@ -1427,16 +2783,26 @@ class BaseProject {
 
     // Lesson 19
     void createRenderPass() {
+        renderPass = buildRenderPass(false);
+        lateRenderPass = buildRenderPass(true);
+    }
+
+    // Both passes are compatible, so they share pipelines and framebuffers.
+    // Between them the depth is in SHADER_READ_ONLY_OPTIMAL layout, to be
+    // reduced into the depth pyramid. The color is left ready to be blitted
+    // into the swap chain.
+    VkRenderPass buildRenderPass(bool late) {
         VkAttachmentDescription depthAttachment{};
         depthAttachment.format = VK_FORMAT_D32_SFLOAT;
         depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.loadOp = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depthAttachment.storeOp = late ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
         depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        depthAttachment.finalLayout =
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        depthAttachment.initialLayout = late ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+                                             : VK_IMAGE_LAYOUT_UNDEFINED;
+        depthAttachment.finalLayout = late ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                                           : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
         VkAttachmentReference depthAttachmentRef{};
         depthAttachmentRef.attachment = 1;
@@ -1446,12 +2812,14 @@ class BaseProject {
         VkAttachmentDescription colorAttachment{};
         colorAttachment.format = swapChainImageFormat;
         colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        colorAttachment.loadOp = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
         colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
         colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        colorAttachment.initialLayout = late ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                                             : VK_IMAGE_LAYOUT_UNDEFINED;
+        colorAttachment.finalLayout = late ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                           : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
         VkAttachmentReference colorAttachmentRef{};
         colorAttachmentRef.attachment = 0;
@@ -1463,13 +2831,39 @@ class BaseProject {
         subpass.pColorAttachments = &colorAttachmentRef;
         subpass.pDepthStencilAttachment = &depthAttachmentRef;
 
-        VkSubpassDependency dependency{};
-        dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-        dependency.dstSubpass = 0;
-        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.srcAccessMask = 0;
-        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        // the depth is read by compute shaders between the passes, the color
+        // by the blit of the previous frame before it is drawn again
+        array<VkSubpassDependency, 2> dependencies{};
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                       VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dependencies[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                       VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                                        VK_ACCESS_TRANSFER_READ_BIT |
+                                        VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
         array<VkAttachmentDescription, 2> attachments = {colorAttachment,
                                                          depthAttachment};
@@ -1477,46 +2871,57 @@ class BaseProject {
         VkRenderPassCreateInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
         renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
-        ;
         renderPassInfo.pAttachments = attachments.data();
         renderPassInfo.subpassCount = 1;
         renderPassInfo.pSubpasses = &subpass;
-        renderPassInfo.dependencyCount = 1;
-        renderPassInfo.pDependencies = &dependency;
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        renderPassInfo.pDependencies = dependencies.data();
 
+        VkRenderPass pass;
         VkResult result =
-            vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass);
+            vkCreateRenderPass(device, &renderPassInfo, nullptr, &pass);
         if (result != VK_SUCCESS) {
             PrintVkError(result);
             throw runtime_error("failed to create render pass!");
         }
+        return pass;
     }
 
     // Lesson 22.2
+    // A single framebuffer, on the offscreen targets: the swap chain images
+    // are only written by the blit
     void createFramebuffers() {
-        swapChainFramebuffers.resize(swapChainImageViews.size());
-        for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-            array<VkImageView, 2> attachments = {swapChainImageViews[i],
-                                                 depthImageView};
-
-            VkFramebufferCreateInfo framebufferInfo{};
-            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            framebufferInfo.renderPass = renderPass;
-            framebufferInfo.attachmentCount =
-                static_cast<uint32_t>(attachments.size());
-            ;
-            framebufferInfo.pAttachments = attachments.data();
-            framebufferInfo.width = swapChainExtent.width;
-            framebufferInfo.height = swapChainExtent.height;
-            framebufferInfo.layers = 1;
-
-            VkResult result = vkCreateFramebuffer(device, &framebufferInfo, nullptr,
-                                                  &swapChainFramebuffers[i]);
-            if (result != VK_SUCCESS) {
-                PrintVkError(result);
-                throw runtime_error("failed to create framebuffer!");
-            }
+        createImage(swapChainExtent.width, swapChainExtent.height, 1, swapChainImageFormat,
+                    VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, sceneColorImage, sceneColorImageMemory);
+        sceneColorImageView = createImageView(sceneColorImage, swapChainImageFormat,
+                                              VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_IMAGE_VIEW_TYPE_2D, 1);
+
+        array<VkImageView, 2> attachments = {sceneColorImageView, depthImageView};
+
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount =
+            static_cast<uint32_t>(attachments.size());
+        framebufferInfo.pAttachments = attachments.data();
+        framebufferInfo.width = swapChainExtent.width;
+        framebufferInfo.height = swapChainExtent.height;
+        framebufferInfo.layers = 1;
+
+        VkResult result = vkCreateFramebuffer(device, &framebufferInfo, nullptr,
+                                              &sceneFramebuffer);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to create framebuffer!");
         }
+        renderExtent = scaledExtent(resolutionScale);
+    }
+
+    VkExtent2D scaledExtent(float scale) {
+        return {std::max(1u, (uint32_t)(swapChainExtent.width * scale + 0.5f)),
+                std::max(1u, (uint32_t)(swapChainExtent.height * scale + 0.5f))};
     }
 
     // Lesson 13
@@ -1543,7 +2948,8 @@ class BaseProject {
 
         createImage(
             swapChainExtent.width, swapChainExtent.height, 1, depthFormat,
-            VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
         depthImageView =
             createImageView(depthImage, depthFormat,
@@ -1757,19 +3163,192 @@ class BaseProject {
     }
 
     // New - Lesson 23
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+    // Uploads no longer stall the queue: the submission signals the next
+    // timeline value, the next frame waits for it on the GPU and the command
+    // buffer (like the caller's staging buffers) is freed once it is reached.
+    // Uploads are ordered among themselves by the barriers they record.
+    uint64_t endSingleTimeCommands(VkCommandBuffer commandBuffer) {
         vkEndCommandBuffer(commandBuffer);
 
+        uint64_t signalValue = ++timelineValue;
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &signalValue;
+
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &commandBuffer;
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue);
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &timelineSemaphore;
+        VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to submit upload command buffer!");
+        }
+        uploadTimelineValue = signalValue;
+
+        deferDestroy(signalValue, [this, commandBuffer]() {
+            vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+        });
+        collectDeletions();
+        return signalValue;
+    }
+
+    // Lesson 22.3 --- Timeline semaphore
+    void createTimelineSemaphore() {
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &typeInfo;
+
+        VkResult result = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &timelineSemaphore);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to create timeline semaphore!");
+        }
+    }
+
+    // The start of every frame and the end of its scene, before the blit to
+    // the swap chain, are timestamped on the GPU, for the dynamic resolution
+    // and, without present wait, for the latency.
+    // GPU ticks are turned into steadyTime() with a timestamp written by an
+    // empty submission: it lands between the submit and the end of the wait,
+    // so the offset is off by at most half of that interval.
+    void createTimestampQueries() {
+        frameLatency.assign(framesInFlight, LatencySample());
+        stats.latency.reserve(4096);  // grown only in long sessions
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        if (!deviceProperties.limits.timestampComputeAndGraphics) {
+            cout << "GPU timestamps not supported, fixed resolution\n";
+            return;
+        }
+        timestampPeriod = deviceProperties.limits.timestampPeriod * 1e-9;
+
+        VkQueryPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        poolInfo.queryCount = 2 * framesInFlight;
+        VkResult result = vkCreateQueryPool(device, &poolInfo, nullptr, &timestampPool);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to create timestamp query pool!");
+        }
+
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        vkCmdResetQueryPool(commandBuffer, timestampPool, 0, 2 * framesInFlight);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, 0);
+        double before = steadyTime();
+        waitTimeline(endSingleTimeCommands(commandBuffer));
+        double after = steadyTime();
+        uint64_t ticks;
+        vkGetQueryPoolResults(device, timestampPool, 0, 1, sizeof(ticks), &ticks, sizeof(ticks),
+                              VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        gpuTimeOffset = (before + after) / 2.0 - ticks * timestampPeriod;
+    }
+
+    // Render thread, before the uniforms of the frame are submitted: the
+    // frame carries the press if no earlier frame did
+    void latchInput(uint32_t frame, const InputStamp &input) {
+        if (input.id > lastLatchedInput) {
+            frameLatency[frame] = LatencySample();
+            frameLatency[frame].input = input;
+            frameLatency[frame].latched = steadyTime();
+            lastLatchedInput = input.id;
+        }
+    }
+
+    // Render thread, at every frame start: the completion is seen at most a
+    // frame late, vkWaitForPresentKHR is not called with a timeout because the
+    // swap chain cannot be used by another thread in the meantime
+    void collectLatency() {
+        while (!pendingLatency.empty()) {
+            LatencySample &sample = pendingLatency.front();
+            if (presentWaitSupported) {
+                VkResult result = waitForPresent(device, swapChain, sample.presentId, 0);
+                if (result == VK_TIMEOUT) {
+                    return;
+                }
+                if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+                    pendingLatency.pop();  // e.g. out of date, never shown
+                    continue;
+                }
+                sample.completed = steadyTime();
+            } else {
+                if (sample.timelineValue > completedTimelineValue()) {
+                    return;
+                }
+                sample.completed = sample.presented;
+                if (timestampPool != VK_NULL_HANDLE) {
+                    uint64_t ticks;
+                    vkGetQueryPoolResults(device, timestampPool, 2 * sample.frameSlot + 1, 1, sizeof(ticks),
+                                          &ticks, sizeof(ticks), VK_QUERY_RESULT_64_BIT);
+                    sample.completed = max(sample.presented, gpuTimeOffset + ticks * timestampPeriod);
+                }
+            }
+            stats.latency.push_back(sample);
+            pendingLatency.pop();
+        }
+    }
+
+    // Last value the GPU has signaled: all the submissions up to it are complete
+    uint64_t completedTimelineValue() {
+        uint64_t value;
+        vkGetSemaphoreCounterValue(device, timelineSemaphore, &value);
+        return value;
+    }
 
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    void waitTimeline(uint64_t value) {
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &timelineSemaphore;
+        waitInfo.pValues = &value;
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
     }
 
+    void deferDestroy(uint64_t value, std::function<void()> destroy) {
+        deletionQueue.push_back({value, std::move(destroy)});
+    }
+
+    void deferDestroyBuffer(uint64_t value, VkBuffer buffer, VkDeviceMemory memory) {
+        deferDestroy(value, [this, buffer, memory]() {
+            vkDestroyBuffer(device, buffer, nullptr);
+            vkFreeMemory(device, memory, nullptr);
+        });
+    }
+
+    // Timeline values only grow, so the queue is sorted
+    void collectDeletions() {
+        uint64_t completed = completedTimelineValue();
+        while (!deletionQueue.empty() && deletionQueue.front().timelineValue <= completed) {
+            deletionQueue.front().destroy();
+            deletionQueue.pop_front();
+        }
+    }
+
+   public:
+    // Frames submitted that the GPU has not finished yet
+    uint32_t gpuFrameLag() {
+        uint64_t completed = completedTimelineValue();
+        uint32_t lag = 0;
+        for (uint64_t value : frameTimelineValues) {
+            if (value > completed) {
+                lag++;
+            }
+        }
+        return lag;
+    }
+
+   protected:
+
     // Lesson 22.4
 
     // Lesson 21
@@ -1825,15 +3404,23 @@ class BaseProject {
 
     // Lesson 21
     void createDescriptorPool() {
-        array<VkDescriptorPoolSize, 2> poolSizes{};
+        vector<VkDescriptorPoolSize> poolSizes(2);
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         poolSizes[0].descriptorCount =
-            static_cast<uint32_t>(uniformBlocksInPool * swapChainImages.size());
+            static_cast<uint32_t>(uniformBlocksInPool * framesInFlight);
         // New - Lesson 23
         poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         poolSizes[1].descriptorCount =
-            static_cast<uint32_t>(texturesInPool * swapChainImages.size());
+            static_cast<uint32_t>(texturesInPool * framesInFlight);
         //
+        // pool sizes cannot be empty
+        if (storageBlocksInPool > 0) {
+            VkDescriptorPoolSize storageSize{};
+            storageSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            storageSize.descriptorCount =
+                static_cast<uint32_t>(storageBlocksInPool * framesInFlight);
+            poolSizes.push_back(storageSize);
+        }
 
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1841,7 +3428,7 @@ class BaseProject {
         ;
         poolInfo.pPoolSizes = poolSizes.data();
         poolInfo.maxSets =
-            static_cast<uint32_t>(setsInPool * swapChainImages.size());
+            static_cast<uint32_t>(setsInPool * framesInFlight);
 
         VkResult result =
             vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool);
@@ -1851,92 +3438,486 @@ class BaseProject {
         }
     }
 
-    virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
+    // Here the application submits to the render queue everything it wants to
+    // draw this frame. Called every frame right after updateUniformBuffer.
+    virtual void populateRenderQueue(RenderQueue &queue, uint32_t currentFrame) = 0;
 
-    // Lesson 22.5 (and 13)
-    void createCommandBuffers() {
-        // Lesson 13
-        commandBuffers.resize(swapChainFramebuffers.size());
+    // Work recorded in the primary command buffer before the render pass
+    // begins, e.g. compute dispatches producing indirect draws
+    virtual void recordComputeCommands(VkCommandBuffer commandBuffer, uint32_t currentFrame) {}
+
+    // Work recorded once the depth pyramid of this frame is built, before the
+    // late render pass, e.g. occlusion culling of what was not drawn yet
+    virtual void recordLateComputeCommands(VkCommandBuffer commandBuffer, uint32_t currentFrame) {}
+
+    // Lesson 13 - transient pools are meant to be reset as a whole every frame
+    VkCommandPool createTransientCommandPool() {
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
+        VkCommandPool pool;
+        VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &pool);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to create transient command pool!");
+        }
+        return pool;
+    }
+
+    VkCommandBuffer allocateCommandBuffer(VkCommandPool pool, VkCommandBufferLevel level) {
         VkCommandBufferAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+        allocInfo.commandPool = pool;
+        allocInfo.level = level;
+        allocInfo.commandBufferCount = 1;
 
-        VkResult result =
-            vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data());
+        VkCommandBuffer commandBuffer;
+        VkResult result = vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
         if (result != VK_SUCCESS) {
             PrintVkError(result);
             throw runtime_error("failed to allocate command buffers!");
         }
+        return commandBuffer;
+    }
 
-        // Lesson 22.5 --- Draw calls
-        // This is where the commands that actually draw something on screen are!
-        for (size_t i = 0; i < commandBuffers.size(); i++) {
-            VkCommandBufferBeginInfo beginInfo{};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            beginInfo.flags = 0;                   // Optional
-            beginInfo.pInheritanceInfo = nullptr;  // Optional
+    // Lesson 22.5 (and 13)
+    // Command buffers are no longer recorded once at init: here we only create
+    // the per-frame pools of the primary buffer and of each slice.
+    void createCommandBuffers() {
+        frameCommandPools.resize(framesInFlight);
+        commandBuffers.resize(framesInFlight);
+        for (size_t i = 0; i < framesInFlight; i++) {
+            frameCommandPools[i] = createTransientCommandPool();
+            commandBuffers[i] = allocateCommandBuffer(frameCommandPools[i], VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+        }
 
-            if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) {
-                throw runtime_error("failed to begin recording command buffer!");
+        recordingSlices.resize(commandBufferSlices);
+        recordingJobs.resize(commandBufferSlices);
+        for (int slice = 0; slice < commandBufferSlices; slice++) {
+            RecordingSlice &buffers = recordingSlices[slice];
+            buffers.commandPools.resize(framesInFlight);
+            buffers.commandBuffers.resize(framesInFlight);
+            for (size_t i = 0; i < framesInFlight; i++) {
+                buffers.commandPools[i] = createTransientCommandPool();
+                buffers.commandBuffers[i] = allocateCommandBuffer(buffers.commandPools[i], VK_COMMAND_BUFFER_LEVEL_SECONDARY);
             }
 
-            VkRenderPassBeginInfo renderPassInfo{};
-            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            renderPassInfo.renderPass = renderPass;
-            renderPassInfo.framebuffer = swapChainFramebuffers[i];
-            renderPassInfo.renderArea.offset = {0, 0};
-            renderPassInfo.renderArea.extent = swapChainExtent;
+            Job &job = recordingJobs[slice];
+            job.function = [](void *data, size_t begin, size_t end) {
+                BaseProject *bp = static_cast<BaseProject *>(data);
+                bp->recordSecondaryCommandBuffer((int)begin, bp->recordingFrame, bp->recordingImage);
+            };
+            job.data = this;
+            job.begin = slice;
+            job.end = slice + 1;
+        }
+        cout << framesInFlight << " frame(s) in flight, " << commandBufferSlices
+             << " command buffer slice(s), " << jobs.workers.size() << " job worker(s)\n\n";
+    }
+
+    void recordSecondaryCommandBuffer(int slice, size_t frame, uint32_t image) {
+        RecordingSlice &buffers = recordingSlices[slice];
+        auto startTime = chrono::high_resolution_clock::now();
+
+        // The frame fence has already been waited on, so the whole pool can be recycled
+        vkResetCommandPool(device, buffers.commandPools[frame], 0);
+        VkCommandBuffer commandBuffer = buffers.commandBuffers[frame];
+
+        VkCommandBufferInheritanceInfo inheritanceInfo{};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritanceInfo.renderPass = renderPass;
+        inheritanceInfo.subpass = 0;
+        inheritanceInfo.framebuffer = sceneFramebuffer;
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                          VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw runtime_error("failed to begin recording secondary command buffer!");
+        }
+
+        size_t queueSize = renderQueueSplit;
+        size_t begin = queueSize * slice / commandBufferSlices;
+        size_t end = queueSize * (slice + 1) / commandBufferSlices;
+        buffers.queueStats = RenderQueueStats();
+        setViewportAndScissor(commandBuffer);
+        renderQueue.replay(commandBuffer, begin, end, buffers.queueStats);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw runtime_error("failed to record secondary command buffer!");
+        }
+
+        buffers.lastRecordingTime = chrono::duration<double, milli>(
+                                       chrono::high_resolution_clock::now() - startTime)
+                                       .count();
+        buffers.totalRecordingTime += buffers.lastRecordingTime;
+    }
+
+    // Lesson 22.5 --- Draw calls
+    // This is where the commands that actually draw something on screen are!
+    // The slices are recorded in parallel and then executed from the primary buffer.
+    void recordCommandBuffer(uint32_t imageIndex) {
+        auto startTime = chrono::high_resolution_clock::now();
+
+        vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+        VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+
+        // the slices are recorded while this thread records the compute work
+        recordingFrame = currentFrame;
+        recordingImage = imageIndex;
+        for (Job &job : recordingJobs) {
+            jobs.schedule(job, recordingCounter);
+        }
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        beginInfo.pInheritanceInfo = nullptr;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw runtime_error("failed to begin recording command buffer!");
+        }
 
-            array<VkClearValue, 2> clearValues{};
-            clearValues[0].color = initialBackgroundColor;
-            clearValues[1].depthStencil = {1.0f, 0};
+        if (timestampPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, timestampPool, 2 * currentFrame, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                timestampPool, 2 * currentFrame);
+        }
+
+        recordComputeCommands(commandBuffer, currentFrame);
+
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = sceneFramebuffer;
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = renderExtent;
+
+        array<VkClearValue, 2> clearValues{};
+        clearValues[0].color = initialBackgroundColor;
+        clearValues[1].depthStencil = {1.0f, 0};
+
+        renderPassInfo.clearValueCount =
+            static_cast<uint32_t>(clearValues.size());
+        renderPassInfo.pClearValues = clearValues.data();
+
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                             VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+        jobs.wait(recordingCounter);
+
+        VkCommandBuffer *secondaries = frameArena.allocate<VkCommandBuffer>(commandBufferSlices);
+        stats.lastQueueStats = RenderQueueStats();
+        for (int slice = 0; slice < commandBufferSlices; slice++) {
+            secondaries[slice] = recordingSlices[slice].commandBuffers[currentFrame];
+            stats.lastQueueStats.add(recordingSlices[slice].queueStats);
+        }
+        stats.totalQueueStats.add(stats.lastQueueStats);
+        vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(commandBufferSlices), secondaries);
+
+        vkCmdEndRenderPass(commandBuffer);
+
+        depthPyramid.record(commandBuffer);
+        recordLateComputeCommands(commandBuffer, currentFrame);
+
+        // few draws, recorded inline on this thread
+        renderPassInfo.renderPass = lateRenderPass;
+        renderPassInfo.clearValueCount = 0;
+        renderPassInfo.pClearValues = nullptr;
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        RenderQueueStats lateStats;
+        setViewportAndScissor(commandBuffer);
+        renderQueue.replay(commandBuffer, renderQueueSplit, renderQueue.size(), lateStats);
+        vkCmdEndRenderPass(commandBuffer);
+        stats.lastQueueStats.add(lateStats);
+        stats.totalQueueStats.add(lateStats);
+
+        // before the blit: it waits for the presentation engine to release
+        // the swap chain image, which is not rendering time
+        if (timestampPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                timestampPool, 2 * currentFrame + 1);
+        }
+
+        recordSceneBlit(commandBuffer, swapChainImages[imageIndex]);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw runtime_error("failed to record command buffer!");
+        }
 
-            renderPassInfo.clearValueCount =
-                static_cast<uint32_t>(clearValues.size());
-            renderPassInfo.pClearValues = clearValues.data();
+        stats.lastPrimaryRecordingTime = chrono::duration<double, milli>(
+                                             chrono::high_resolution_clock::now() - startTime)
+                                             .count();
+        stats.totalPrimaryRecordingTime += stats.lastPrimaryRecordingTime;
+    }
 
-            vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-                                 VK_SUBPASS_CONTENTS_INLINE);
+    // Scales the rendered part of the offscreen target to the whole swap
+    // chain image, with a linear filter, and leaves the image ready to present
+    void recordSceneBlit(VkCommandBuffer commandBuffer, VkImage swapChainImage) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = swapChainImage;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+        // the acquire semaphore is waited at the transfer stage too, see drawFrame
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
 
-            populateCommandBuffer(commandBuffers[i], i);
+        VkImageBlit blit{};
+        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.srcSubresource.mipLevel = 0;
+        blit.srcSubresource.baseArrayLayer = 0;
+        blit.srcSubresource.layerCount = 1;
+        blit.srcOffsets[0] = {0, 0, 0};
+        blit.srcOffsets[1] = {(int32_t)renderExtent.width, (int32_t)renderExtent.height, 1};
+        blit.dstSubresource = blit.srcSubresource;
+        blit.dstOffsets[0] = {0, 0, 0};
+        blit.dstOffsets[1] = {(int32_t)swapChainExtent.width, (int32_t)swapChainExtent.height, 1};
+        vkCmdBlitImage(commandBuffer, sceneColorImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       swapChainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                       VK_FILTER_LINEAR);
 
-            vkCmdEndRenderPass(commandBuffers[i]);
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+    }
 
-            if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-                throw runtime_error("failed to record command buffer!");
+    // Reads the GPU time of the scene of the last frame recorded in this slot
+    // (without the blit to the swap chain and the wait for its image) and
+    // moves the scale towards the budget. The GPU time goes roughly with the
+    // pixel count, the square of the scale; the scale moves in 5% steps, goes
+    // up only with a clear margin and waits a few frames after every change,
+    // so that it does not oscillate.
+    void updateResolutionScale() {
+        uint64_t ticks[2];
+        if (timestampPool != VK_NULL_HANDLE && frameTimelineValues[currentFrame] != 0 &&
+            vkGetQueryPoolResults(device, timestampPool, 2 * currentFrame, 2, sizeof(ticks), ticks,
+                                  sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            double gpuTime = (ticks[1] - ticks[0]) * timestampPeriod;
+            stats.lastGpuTime = gpuTime;
+            stats.totalGpuTime += gpuTime;
+            stats.gpuTimedFrames++;
+            smoothedGpuTime = gpuTimeSamples == 0 ? gpuTime : glm::mix(smoothedGpuTime, gpuTime, 0.1);
+            gpuTimeSamples++;
+
+            if (gpuTimeBudget > 0.0 && gpuTimeSamples > 8 + framesInFlight) {
+                float scale = resolutionScale * (float)sqrt(gpuTimeBudget / smoothedGpuTime);
+                scale = glm::clamp(round(scale * 20.0f) / 20.0f, minResolutionScale, 1.0f);
+                if (scale < resolutionScale ||
+                    (scale > resolutionScale && smoothedGpuTime < 0.85 * gpuTimeBudget)) {
+                    resolutionScale = scale;
+                    gpuTimeSamples = 0;
+                }
             }
         }
+        renderExtent = scaledExtent(resolutionScale);
+    }
+
+    // Dynamic states of every pipeline; secondary buffers do not inherit them
+    void setViewportAndScissor(VkCommandBuffer commandBuffer) {
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = (float)renderExtent.width;
+        viewport.height = (float)renderExtent.height;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+        VkRect2D scissor{};
+        scissor.offset = {0, 0};
+        scissor.extent = renderExtent;
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    }
+
+    // Frustum culling of the given bounding spheres, visible gets the indices
+    // of the ones to draw. The counts end up in the frame stats
+    void cullObjects(const glm::mat4 &viewProj, const std::vector<glm::vec4> &spheres,
+                     std::vector<uint32_t> &visible) {
+        visible.clear();
+        Frustum::fromMatrix(viewProj).cull(spheres, visible);
+
+        uint32_t culled = static_cast<uint32_t>(spheres.size() - visible.size());
+        stats.lastVisible += static_cast<uint32_t>(visible.size());
+        stats.lastCulled += culled;
+        stats.totalVisible += visible.size();
+        stats.totalCulled += culled;
+    }
+
+    // Render thread, after every frame: what all the threads allocated since
+    // the previous one. The first frames fill the pools and the caches, they
+    // are left out
+    void countAllocations() {
+        uint64_t count = heapAllocations.load(std::memory_order_relaxed);
+        uint64_t allocations = count - allocationsSeen;
+        allocationsSeen = count;
+        if (!COUNT_ALLOCATIONS || stats.frames <= allocationWarmupFrames) {
+            return;
+        }
+        stats.allocationFrames++;
+        stats.lastAllocations = allocations;
+        stats.totalAllocations += allocations;
+        stats.maxAllocations = max(stats.maxAllocations, allocations);
+        if (allocations > 0) {
+            stats.allocatingFrames++;
+        }
+        if (allocationCheckFrames > 0 && stats.allocationFrames == allocationCheckFrames) {
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+            glfwPostEmptyEvent();
+        }
+    }
+
+    void printFrameStats() {
+        if (stats.frames == 0) {
+            return;
+        }
+        cout << "Frames rendered: " << stats.frames << "\n";
+        cout << "Frustum culling, last frame: " << stats.lastVisible << " visible, "
+             << stats.lastCulled << " culled; avg. per frame: "
+             << (double)stats.totalVisible / stats.frames << " visible, "
+             << (double)stats.totalCulled / stats.frames << " culled\n";
+        const RenderQueueStats &last = stats.lastQueueStats;
+        const RenderQueueStats &total = stats.totalQueueStats;
+        cout << "Last frame: " << last.draws << " draws, " << last.pipelineBinds
+             << " pipeline binds, " << last.descriptorSetBinds << " descriptor set binds, "
+             << last.bufferBinds << " buffer binds\n";
+        cout << "Avg. per frame: " << (double)total.draws / stats.frames << " draws, "
+             << (double)(total.pipelineBinds + total.descriptorSetBinds + total.bufferBinds) / stats.frames
+             << " binds\n";
+        cout << "Avg. GPU lag: " << (double)stats.totalGpuLag / stats.frames
+             << " frame(s), of at most " << framesInFlight << "\n";
+        cout << "Avg. primary recording time: "
+             << stats.totalPrimaryRecordingTime / stats.frames << " ms\n";
+        for (size_t i = 0; i < recordingSlices.size(); i++) {
+            cout << "\tRecording slice " << i << ": avg. "
+                 << recordingSlices[i].totalRecordingTime / stats.frames << " ms, last "
+                 << recordingSlices[i].lastRecordingTime << " ms\n";
+        }
+        cout << "Job system: " << jobs.workers.size() << " worker(s), utilization "
+             << jobs.utilization() * 100.0 << "%, " << jobs.jobsRun() << " jobs run ("
+             << jobs.jobsStolen() << " stolen)\n";
+        if (stats.gpuTimedFrames > 0) {
+            cout << "GPU scene time (without the swap chain blit): avg. " << stats.totalGpuTime / stats.gpuTimedFrames * 1000.0
+                 << " ms, last " << stats.lastGpuTime * 1000.0 << " ms, budget "
+                 << gpuTimeBudget * 1000.0 << " ms\n";
+        }
+        cout << "Resolution scale: last " << resolutionScale << " (" << renderExtent.width << "x"
+             << renderExtent.height << "), avg. " << stats.totalResolutionScale / stats.frames
+             << ", min " << stats.minResolutionScale << "\n";
+        if (stats.allocationFrames > 0) {
+            cout << "Heap allocations per frame: avg. "
+                 << (double)stats.totalAllocations / stats.allocationFrames << ", max "
+                 << stats.maxAllocations << ", " << stats.allocatingFrames << " of "
+                 << stats.allocationFrames << " frames allocating\n";
+        }
+        if (renderInput.dropped + simulationInput.dropped > 0) {
+            cout << "Input events dropped: " << renderInput.dropped << " render, "
+                 << simulationInput.dropped << " simulation\n";
+        }
+        printLatencyStats();
+        printPacingStats();
+    }
+
+    // What matters for power: how much was drawn, and how much CPU it took.
+    // clock() is the CPU time of the whole process (all threads) on POSIX
+    // systems, but the wall time with the Microsoft runtime.
+    void printPacingStats() {
+        double session = stats.sessionEnd - stats.sessionStart;
+        if (session <= 0.0) {
+            return;
+        }
+        cout << "Frame pacing: limit " << targetFrameRate << " fps, idle " << idleFrameRate << " fps\n";
+        cout << "\t" << stats.frames << " frames in " << session << " s (avg. "
+             << stats.frames / session << " fps), " << stats.idleFrames << " idle\n";
+        if (stats.pacedFrames > 0) {
+            cout << "\tFrame start jitter: avg. " << stats.totalJitter / stats.pacedFrames * 1000.0
+                 << " ms, max " << stats.maxJitter * 1000.0 << " ms\n";
+        }
+        double cpuTime = (double)(stats.cpuEnd - stats.cpuStart) / CLOCKS_PER_SEC;
+        cout << "\tRender thread waiting for its frames: " << stats.pacingWait / session * 100.0
+             << "% of the time\n";
+        cout << "\tProcess CPU time: " << cpuTime << " s (" << cpuTime / session * 100.0
+             << "% of one core)\n";
+    }
+
+    // p-th percentile (0..100) of values, in place
+    static double percentile(vector<double> &values, double p) {
+        size_t n = (size_t)(p / 100.0 * (values.size() - 1) + 0.5);
+        nth_element(values.begin(), values.begin() + n, values.end());
+        return values[n];
+    }
+
+    // The whole latency and where it goes, with the settings it depends on
+    void printLatencyStats() {
+        if (stats.latency.empty()) {
+            return;
+        }
+        const char *method = presentWaitSupported          ? "present wait"
+                             : timestampPool != VK_NULL_HANDLE ? "GPU timestamps"
+                                                               : "present return";
+        cout << "Input-to-photon latency (" << method << ", " << PresentModeName(swapChainPresentMode)
+             << ", " << framesInFlight << " frame(s) in flight), " << stats.latency.size() << " presses:\n";
+        if (stats.droppedLatency > 0) {
+            cout << "\t" << stats.droppedLatency << " more presses not measured, too many pending\n";
+        }
+
+        // from the key callback to: the tick, the uniforms, submit, present, screen
+        const char *stages[] = {"total", "input to tick", "tick to latch", "latch to submit",
+                                "submit to present", "present to screen"};
+        vector<double> values[6];
+        for (const LatencySample &l : stats.latency) {
+            values[0].push_back(l.completed - l.input.received);
+            values[1].push_back(l.input.applied - l.input.received);
+            values[2].push_back(l.latched - l.input.applied);
+            values[3].push_back(l.submitted - l.latched);
+            values[4].push_back(l.presented - l.submitted);
+            values[5].push_back(l.completed - l.presented);
+        }
+        for (int i = 0; i < 6; i++) {
+            cout << "\t" << stages[i] << ": p50 " << percentile(values[i], 50) * 1000.0
+                 << " ms, p95 " << percentile(values[i], 95) * 1000.0
+                 << " ms, p99 " << percentile(values[i], 99) * 1000.0 << " ms\n";
+        }
     }
 
     // Lesson 22.5
     void createSyncObjects() {
-        imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-        imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+        imageAvailableSemaphores.resize(framesInFlight);
+        renderFinishedSemaphores.resize(framesInFlight);
+        frameTimelineValues.resize(framesInFlight, 0);
 
         VkSemaphoreCreateInfo semaphoreInfo{};
         semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < framesInFlight; i++) {
             VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
                                                  &imageAvailableSemaphores[i]);
             VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
                                                  &renderFinishedSemaphores[i]);
-            VkResult result3 =
-                vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]);
-            if (result1 != VK_SUCCESS || result2 != VK_SUCCESS ||
-                result3 != VK_SUCCESS) {
+            if (result1 != VK_SUCCESS || result2 != VK_SUCCESS) {
                 PrintVkError(result1);
                 PrintVkError(result2);
-                PrintVkError(result3);
                 throw runtime_error(
                     "failed to create synchronization objects for a frame!!");
             }
@@ -1944,59 +3925,240 @@ class BaseProject {
     }
 
     // Lesson 22.6 --- Main Rendering Loop
+    // The main thread waits for window events, so input is handled even when
+    // the render thread is blocked on the GPU or on the presentation engine.
+    // The frame packets coming back are shown in the window title.
     void mainLoop() {
+        stats.sessionStart = steadyTime();
+        stats.cpuStart = clock();
+        simulationThread = std::thread(&BaseProject::simulationLoop, this);
+        renderThread = std::thread(&BaseProject::renderLoop, this);
+
+        double titleTime = glfwGetTime();
+        uint64_t titleFrames = 0;
+        FramePacket lastPacket{};
         while (!glfwWindowShouldClose(window)) {
-            glfwPollEvents();
-            drawFrame();
+            glfwWaitEventsTimeout(0.01);
+            renderInput.flush();
+            simulationInput.flush();
+
+            FramePacket packet;
+            while (framePackets.pop(packet)) {
+                lastPacket = packet;
+                titleFrames++;
+            }
+            double now = glfwGetTime();
+            if (now - titleTime >= 1.0) {
+                // formatted in place, not to show up in the allocation counts
+                char title[256];
+                snprintf(title, sizeof(title), "%s - %d fps, GPU lag %u, %d%% resolution", windowTitle.c_str(),
+                         (int)(titleFrames / (now - titleTime)), lastPacket.gpuLag,
+                         (int)(lastPacket.resolutionScale * 100.0f + 0.5f));
+                glfwSetWindowTitle(window, title);
+                titleTime = now;
+                titleFrames = 0;
+            }
         }
 
+        threadsQuit = true;
+        pacer.wake();
+        renderThread.join();
+        simulationThread.join();
+        stats.sessionEnd = steadyTime();
+        stats.cpuEnd = clock();
         vkDeviceWaitIdle(device);
+        if (renderError) {
+            rethrow_exception(renderError);
+        }
+        if (simulationError) {
+            rethrow_exception(simulationError);
+        }
     }
 
-    // Lesson 22.6
-    void drawFrame() {
-        vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
-                        UINT64_MAX);
+    // One tick of the application logic, on the simulation thread:
+    // dt is always 1 / simulationRate
+    virtual void simulate(float dt) {}
 
-        uint32_t imageIndex;
+    // Called right before vkQueueSubmit, after the command buffer has been
+    // recorded: the uniforms written here (host coherent, persistently mapped)
+    // are the most recent input the frame can show
+    virtual void lateLatch(uint32_t currentFrame) {}
 
-        VkResult result = vkAcquireNextImageKHR(
-            device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame],
-            VK_NULL_HANDLE, &imageIndex);
+    // Seconds on a monotonic clock, shared by all threads (e.g. to interpolate
+    // between the ticks of the simulation on the render thread)
+    static double steadyTime() {
+        return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-        if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-            vkWaitForFences(device, 1, &imagesInFlight[imageIndex], VK_TRUE,
-                            UINT64_MAX);
+    // Real time is accumulated and consumed in fixed ticks, so the outcome of
+    // the simulation does not depend on the frame rate nor on the scheduler
+    void simulationLoop() {
+        try {
+            const double dt = 1.0 / simulationRate;
+            double previous = steadyTime();
+            double accumulator = 0.0;
+            while (!threadsQuit) {
+                double current = steadyTime();
+                accumulator += current - previous;
+                previous = current;
+
+                // the ticks run now cover the real time up to current - accumulator
+                int steps = 0;
+                double tickEnd = current - accumulator + dt;
+                while (accumulator >= dt && steps < maxSimulationSteps) {
+                    processSimulationInput(tickEnd);
+                    simulate((float)dt);
+                    keysPressed.fill(false);
+                    accumulator -= dt;
+                    tickEnd += dt;
+                    steps++;
+                }
+                if (accumulator >= dt) {
+                    // the dropped time is not simulated, its input goes to the next tick
+                    accumulator = 0.0;
+                }
+                this_thread::sleep_for(chrono::duration<double>(dt - accumulator));
+            }
+        } catch (...) {
+            simulationError = current_exception();
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+            glfwPostEmptyEvent();
         }
-        imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+    }
 
-        updateUniformBuffer(imageIndex);
+    // Whether the application has nothing new to show, e.g. a paused game:
+    // asked by the render thread before every frame
+    virtual bool isIdle() { return false; }
 
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-        VkPipelineStageFlags waitStages[] = {
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = waitSemaphores;
+    // Cuts the wait of an idle render thread short, e.g. when the
+    // application stops being idle
+    void wakeRenderThread() {
+        pacer.wake();
+    }
+
+    void renderLoop() {
+        try {
+            auto lastFrameTime = chrono::high_resolution_clock::now();
+            while (!threadsQuit) {
+                bool idle = !windowFocused || isIdle();
+                double rate = idle ? idleFrameRate : targetFrameRate;
+                stats.pacingWait += pacer.wait(rate, idle);
+                if (idle) {
+                    stats.idleFrames++;
+                } else if (rate > 0.0) {
+                    stats.pacedFrames++;
+                    stats.totalJitter += pacer.lastJitter;
+                    stats.maxJitter = max(stats.maxJitter, pacer.lastJitter);
+                }
+
+                processInput();
+                drawFrame();
+                countAllocations();
+
+                auto now = chrono::high_resolution_clock::now();
+                FramePacket packet;
+                packet.frame = stats.frames;
+                packet.frameTime = chrono::duration<double, milli>(now - lastFrameTime).count();
+                packet.gpuLag = gpuFrameLag();
+                packet.resolutionScale = resolutionScale;
+                framePackets.push(packet);  // dropped if the main thread is behind
+                lastFrameTime = now;
+            }
+        } catch (...) {
+            // handed to the main thread, which rethrows it after joining
+            renderError = current_exception();
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+            glfwPostEmptyEvent();
+        }
+    }
+
+    // Lesson 22.6
+    // Frame N waits for frame N - framesInFlight, the last one recorded with
+    // the same slot, then releases what the GPU is done with
+    void drawFrame() {
+        frameArena.reset();
+        waitTimeline(frameTimelineValues[currentFrame]);
+        collectDeletions();
+        collectLatency();
+        updateResolutionScale();
+        stats.totalGpuLag += gpuFrameLag();
+
+        uint32_t imageIndex;
+
+        VkResult result = vkAcquireNextImageKHR(
+            device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame],
+            VK_NULL_HANDLE, &imageIndex);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            recreateSwapChain();
+            return;
+        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            PrintVkError(result);
+            throw runtime_error("failed to acquire swap chain image!");
+        }
+
+        // Every resource written by the CPU below belongs to currentFrame, whose
+        // last frame has just been waited: the image index is only used to pick the
+        // framebuffer, so there is no need to wait for the image's last frame
+        updateUniformBuffer(currentFrame);
+
+        renderQueue.clear();
+        stats.lastVisible = 0;
+        stats.lastCulled = 0;
+        populateRenderQueue(renderQueue, currentFrame);
+        renderQueue.sort(frameArena);
+        renderQueueSplit = renderQueue.passBegin(PASS_LATE);
+        recordCommandBuffer(imageIndex);
+
+        // The latest simulation state goes in the mapped uniforms as late as possible
+        frameLatency[currentFrame].input.id = 0;
+        lateLatch(currentFrame);
+
+        // The timeline wait makes the uploads visible to the frame; the values
+        // of the binary semaphores are ignored
+        uint64_t frameValue = ++timelineValue;
+        VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame],
+                                        timelineSemaphore};
+        // the swap chain image is only written by the final blit, the only
+        // transfer command of the frame: the scene does not wait for it
+        VkPipelineStageFlags waitStages[] = {
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+        uint64_t waitValues[] = {0, uploadTimelineValue};
+        VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame],
+                                          timelineSemaphore};
+        uint64_t signalValues[] = {0, frameValue};
+
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = 2;
+        timelineInfo.pWaitSemaphoreValues = waitValues;
+        timelineInfo.signalSemaphoreValueCount = 2;
+        timelineInfo.pSignalSemaphoreValues = signalValues;
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.waitSemaphoreCount = 2;
+        submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
         submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
-        VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+        submitInfo.signalSemaphoreCount = 2;
         submitInfo.pSignalSemaphores = signalSemaphores;
 
-        vkResetFences(device, 1, &inFlightFences[currentFrame]);
-
-        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
-                          inFlightFences[currentFrame]) != VK_SUCCESS) {
+        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
             throw runtime_error("failed to submit draw command buffer!");
         }
+        frameTimelineValues[currentFrame] = frameValue;
+        LatencySample &latency = frameLatency[currentFrame];
+        latency.submitted = steadyTime();
+        latency.timelineValue = frameValue;
+        latency.frameSlot = currentFrame;
 
         VkPresentInfoKHR presentInfo{};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
         presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = signalSemaphores;
+        presentInfo.pWaitSemaphores = &renderFinishedSemaphores[currentFrame];
 
         VkSwapchainKHR swapChains[] = {swapChain};
         presentInfo.swapchainCount = 1;
@@ -2004,18 +4166,105 @@ class BaseProject {
         presentInfo.pImageIndices = &imageIndex;
         presentInfo.pResults = nullptr;  // Optional
 
+        uint64_t presentId = ++presentCount;
+        VkPresentIdKHR presentIdInfo{};
+        presentIdInfo.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+        presentIdInfo.swapchainCount = 1;
+        presentIdInfo.pPresentIds = &presentId;
+        if (presentWaitSupported) {
+            presentInfo.pNext = &presentIdInfo;
+        }
+
         result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        if (latency.input.id != 0 && (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR)) {
+            latency.presented = steadyTime();
+            latency.presentId = presentId;
+            if (!pendingLatency.push(latency)) {
+                stats.droppedLatency++;
+            }
+        }
+
+        stats.frames++;
+        stats.totalResolutionScale += resolutionScale;
+        stats.minResolutionScale = min(stats.minResolutionScale, resolutionScale);
+        currentFrame = (currentFrame + 1) % framesInFlight;
 
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
+            swapChainDirty) {
+            recreateSwapChain();
+        } else if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to present swap chain image!");
+        }
+    }
+
+    // Lesson 22.6 --- Swap chain recreation
+    // Everything sized on the swap chain is rebuilt. The render passes and the
+    // pipelines are kept: the surface format does not change and viewport and
+    // scissor are dynamic states.
+    void recreateSwapChain() {
+        // a minimized window has nothing to present to, wait until it is restored
+        while (framebufferWidth == 0 || framebufferHeight == 0) {
+            if (threadsQuit) {
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+            processInput();
+        }
+
+        vkDeviceWaitIdle(device);
+        // the present ids belong to the old swap chain
+        collectLatency();
+        pendingLatency.clear();
+
+        cleanupSwapChain();
+
+        VkSwapchainKHR oldSwapChain = swapChain;
+        createSwapChain(oldSwapChain);
+        vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+
+        createImageViews();
+        createDepthResources();
+        createFramebuffers();
+        depthPyramid.init(this);
+
+        onSwapChainRecreated();
+        swapChainDirty = false;
+    }
+
+    // Lets the application rewrite the descriptors that refer to resources
+    // rebuilt with the swap chain (e.g. the depth pyramid)
+    virtual void onSwapChainRecreated() {}
+
+    // Destroys what recreateSwapChain() rebuilds, but not the swap chain itself
+    void cleanupSwapChain() {
+        depthPyramid.cleanup();
+        vkDestroyImageView(device, depthImageView, nullptr);
+        vkDestroyImage(device, depthImage, nullptr);
+        vkFreeMemory(device, depthImageMemory, nullptr);
+
+        vkDestroyFramebuffer(device, sceneFramebuffer, nullptr);
+        vkDestroyImageView(device, sceneColorImageView, nullptr);
+        vkDestroyImage(device, sceneColorImage, nullptr);
+        vkFreeMemory(device, sceneColorImageMemory, nullptr);
+
+        for (size_t i = 0; i < swapChainImageViews.size(); i++) {
+            vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+        }
     }
 
-    virtual void updateUniformBuffer(uint32_t currentImage) = 0;
+    virtual void updateUniformBuffer(uint32_t currentFrame) = 0;
 
     virtual void localCleanup() = 0;
 
     // All lessons
 
     void cleanup() {
+        printFrameStats();
+        jobs.stop();
+        // the device is idle, everything left can go
+        collectDeletions();
+
         // destroy SkyBox TD
         vkDestroySampler(device, SkyBox.TD.textureSampler, nullptr);
         vkDestroyImageView(device, SkyBox.TD.textureImageView, nullptr);
@@ -2028,22 +4277,20 @@ class BaseProject {
         vkDestroyBuffer(device, SkyBox.MD.vertexBuffer, nullptr);
         vkFreeMemory(device, SkyBox.MD.vertexBufferMemory, nullptr);
 
-        vkDestroyImageView(device, depthImageView, nullptr);
-        vkDestroyImage(device, depthImage, nullptr);
-        vkFreeMemory(device, depthImageMemory, nullptr);
+        cleanupSwapChain();
 
-        for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
-            vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
+        // destroying a pool also frees the command buffers allocated from it
+        for (size_t i = 0; i < frameCommandPools.size(); i++) {
+            vkDestroyCommandPool(device, frameCommandPools[i], nullptr);
+        }
+        for (auto &buffers : recordingSlices) {
+            for (size_t i = 0; i < buffers.commandPools.size(); i++) {
+                vkDestroyCommandPool(device, buffers.commandPools[i], nullptr);
+            }
         }
-
-        vkFreeCommandBuffers(device, commandPool,
-                             static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
 
         vkDestroyRenderPass(device, renderPass, nullptr);
-
-        for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-            vkDestroyImageView(device, swapChainImageViews[i], nullptr);
-        }
+        vkDestroyRenderPass(device, lateRenderPass, nullptr);
 
         vkDestroySwapchainKHR(device, swapChain, nullptr);
 
@@ -2051,10 +4298,13 @@ class BaseProject {
 
         localCleanup();
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < framesInFlight; i++) {
             vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
             vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-            vkDestroyFence(device, inFlightFences[i], nullptr);
+        }
+        vkDestroySemaphore(device, timelineSemaphore, nullptr);
+        if (timestampPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(device, timestampPool, nullptr);
         }
 
         vkDestroyCommandPool(device, commandPool, nullptr);
@@ -2104,6 +4354,89 @@ void Model::loadModel(string file) {
             indices.push_back(vertices.size() - 1);
         }
     }
+
+    computeBounds();
+}
+
+void Model::computeBounds() {
+    aabbMin = glm::vec3(0.0f);
+    aabbMax = glm::vec3(0.0f);
+    if (!vertices.empty()) {
+        aabbMin = aabbMax = vertices[0].pos;
+    }
+    for (const auto &vertex : vertices) {
+        aabbMin = glm::min(aabbMin, vertex.pos);
+        aabbMax = glm::max(aabbMax, vertex.pos);
+    }
+
+    // Sphere centered in the box, enclosing all the vertices
+    boundCenter = (aabbMin + aabbMax) * 0.5f;
+    float radius2 = 0.0f;
+    for (const auto &vertex : vertices) {
+        glm::vec3 d = vertex.pos - boundCenter;
+        radius2 = std::max(radius2, glm::dot(d, d));
+    }
+    boundRadius = sqrt(radius2);
+
+    footprint.compute(vertices);
+}
+
+// Vertex clustering: each level snaps the vertices to a grid half as fine as
+// the previous one, every cell being represented by the first vertex found in
+// it. Triangles collapsing to a line or a point are dropped and the remaining
+// ones are appended to the index buffer.
+void Model::buildLods(int levels) {
+    uint32_t fullCount = static_cast<uint32_t>(indices.size());
+    lods.clear();
+    lods.push_back({0, fullCount});
+
+    glm::vec3 extent = aabbMax - aabbMin;
+    float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+    if (maxExtent <= 0.0f) {
+        return;
+    }
+
+    int resolution = 16;
+    for (int level = 1; level < levels; level++, resolution /= 2) {
+        float cellSize = maxExtent / resolution;
+        unordered_map<uint64_t, uint32_t> cells;
+        vector<uint32_t> remap(vertices.size());
+        for (uint32_t v = 0; v < vertices.size(); v++) {
+            glm::ivec3 cell = glm::ivec3((vertices[v].pos - aabbMin) / cellSize);
+            uint64_t key = (static_cast<uint64_t>(cell.x) << 42) |
+                           (static_cast<uint64_t>(cell.y) << 21) |
+                           static_cast<uint64_t>(cell.z);
+            remap[v] = cells.emplace(key, v).first->second;
+        }
+
+        MeshLod lod{static_cast<uint32_t>(indices.size()), 0};
+        for (uint32_t i = 0; i + 2 < fullCount; i += 3) {
+            uint32_t a = remap[indices[i]];
+            uint32_t b = remap[indices[i + 1]];
+            uint32_t c = remap[indices[i + 2]];
+            if (a == b || b == c || a == c) {
+                continue;
+            }
+            indices.push_back(a);
+            indices.push_back(b);
+            indices.push_back(c);
+            lod.indexCount += 3;
+        }
+        // a level that lost everything keeps the previous one
+        if (lod.indexCount == 0) {
+            lod = lods.back();
+        }
+        lods.push_back(lod);
+    }
+}
+
+glm::vec4 Model::worldBoundingSphere(const glm::mat4 &modelMatrix) const {
+    glm::vec3 center = glm::vec3(modelMatrix * glm::vec4(boundCenter, 1.0f));
+    // the largest axis scale keeps the sphere conservative
+    float scale = std::max(glm::length(glm::vec3(modelMatrix[0])),
+                           std::max(glm::length(glm::vec3(modelMatrix[1])),
+                                    glm::length(glm::vec3(modelMatrix[2]))));
+    return glm::vec4(center, boundRadius * scale);
 }
 
 // Lesson 21
@@ -2135,13 +4468,22 @@ void Model::createIndexBuffer() {
     vkUnmapMemory(BP->device, indexBufferMemory);
 }
 
-void Model::init(BaseProject *bp, string file) {
-    BP = bp;
+void Model::load(string file, int lodLevels) {
     loadModel(file);
+    buildLods(lodLevels);
+}
+
+void Model::upload(BaseProject *bp) {
+    BP = bp;
     createVertexBuffer();
     createIndexBuffer();
 }
 
+void Model::init(BaseProject *bp, string file, int lodLevels) {
+    load(file, lodLevels);
+    upload(bp);
+}
+
 void Model::cleanup() {
     vkDestroyBuffer(BP->device, indexBuffer, nullptr);
     vkFreeMemory(BP->device, indexBufferMemory, nullptr);
@@ -2191,8 +4533,7 @@ void Texture::createTextureImage(string file) {
     BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                         texWidth, texHeight, mipLevels, 1);
 
-    vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-    vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+    BP->deferDestroyBuffer(BP->uploadTimelineValue, stagingBuffer, stagingBufferMemory);
 }
 
 void Texture::createTextureImageView() {
@@ -2293,25 +4634,22 @@ void Pipeline::init(BaseProject *bp, const string &VertShader, const string &Fra
     inputAssembly.primitiveRestartEnable = VK_FALSE;
 
     // Lesson 19
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float)BP->swapChainExtent.width;
-    viewport.height = (float)BP->swapChainExtent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = BP->swapChainExtent;
-
+    // Viewport and scissor are set when recording, so the pipeline survives
+    // the recreation of the swap chain
     VkPipelineViewportStateCreateInfo viewportState{};
     viewportState.sType =
         VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
+    viewportState.pViewports = nullptr;
     viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
+    viewportState.pScissors = nullptr;
+
+    array<VkDynamicState, 2> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT,
+                                              VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+    dynamicState.pDynamicStates = dynamicStates.data();
 
     VkPipelineRasterizationStateCreateInfo rasterizer{};
     rasterizer.sType =
@@ -2427,7 +4765,7 @@ void Pipeline::init(BaseProject *bp, const string &VertShader, const string &Fra
     pipelineInfo.pMultisampleState = &multisampling;
     pipelineInfo.pDepthStencilState = &depthStencil;
     pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr;  // Optional
+    pipelineInfo.pDynamicState = &dynamicState;
     pipelineInfo.layout = pipelineLayout;
     pipelineInfo.renderPass = BP->renderPass;
     pipelineInfo.subpass = 0;
@@ -2487,6 +4825,273 @@ void Pipeline::cleanup() {
     vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
 }
 
+void ComputePipeline::init(BaseProject *bp, const string &ComputeShader,
+                           vector<DescriptorSetLayout *> D, uint32_t pushConstantSize) {
+    BP = bp;
+
+    auto compShaderCode = Pipeline::readFile(ComputeShader);
+
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = compShaderCode.size();
+    moduleInfo.pCode = reinterpret_cast<const uint32_t *>(compShaderCode.data());
+
+    VkShaderModule compShaderModule;
+    VkResult result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr,
+                                           &compShaderModule);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw runtime_error("failed to create shader module!");
+    }
+
+    vector<VkDescriptorSetLayout> DSL(D.size());
+    for (int i = 0; i < D.size(); i++) {
+        DSL[i] = D[i]->descriptorSetLayout;
+    }
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = DSL.size();
+    pipelineLayoutInfo.pSetLayouts = DSL.data();
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantSize;
+    if (pushConstantSize > 0) {
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    }
+
+    result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+                                    &pipelineLayout);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw runtime_error("failed to create compute pipeline layout!");
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = compShaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipelineLayout;
+
+    result = vkCreateComputePipelines(BP->device, VK_NULL_HANDLE, 1,
+                                      &pipelineInfo, nullptr, &computePipeline);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw runtime_error("failed to create compute pipeline!");
+    }
+
+    vkDestroyShaderModule(BP->device, compShaderModule, nullptr);
+}
+
+void ComputePipeline::cleanup() {
+    vkDestroyPipeline(BP->device, computePipeline, nullptr);
+    vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+}
+
+static uint32_t previousPowerOfTwo(uint32_t v) {
+    uint32_t r = 1;
+    while (r * 2 <= v) {
+        r *= 2;
+    }
+    return r;
+}
+
+void DepthPyramid::init(BaseProject *bp) {
+    BP = bp;
+
+    built = false;
+    width = previousPowerOfTwo(BP->swapChainExtent.width);
+    height = previousPowerOfTwo(BP->swapChainExtent.height);
+    levels = 1;
+    while ((std::max(width, height) >> levels) > 0) {
+        levels++;
+    }
+
+    BP->createImage(width, height, levels, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, imageMemory);
+    texture.BP = BP;
+    texture.mipLevels = levels;
+    texture.textureImage = image;
+    texture.textureImageMemory = imageMemory;
+    texture.textureImageView = BP->createImageView(image, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT,
+                                                   levels, VK_IMAGE_VIEW_TYPE_2D, 1);
+    levelViews.resize(levels);
+    for (uint32_t i = 0; i < levels; i++) {
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = image;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = VK_FORMAT_R32_SFLOAT;
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        viewInfo.subresourceRange.baseMipLevel = i;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = 0;
+        viewInfo.subresourceRange.layerCount = 1;
+        VkResult result = vkCreateImageView(BP->device, &viewInfo, nullptr, &levelViews[i]);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw runtime_error("failed to create depth pyramid level view!");
+        }
+    }
+
+    // texels are fetched, so the sampler never filters
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_NEAREST;
+    samplerInfo.minFilter = VK_FILTER_NEAREST;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(levels);
+    VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr, &texture.textureSampler);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw runtime_error("failed to create depth pyramid sampler!");
+    }
+
+    // Level i is computed from level i - 1, level 0 from the depth attachment
+    DSL.init(BP, {{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT},
+                  {1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT}});
+    reducePipeline.init(BP, "shaders/DepthReduceComp.spv", {&DSL}, 4 * sizeof(uint32_t));
+
+    array<VkDescriptorPoolSize, 2> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[0].descriptorCount = levels;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[1].descriptorCount = levels;
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = levels;
+    result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &descriptorPool);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw runtime_error("failed to create depth pyramid descriptor pool!");
+    }
+
+    vector<VkDescriptorSetLayout> layouts(levels, DSL.descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = levels;
+    allocInfo.pSetLayouts = layouts.data();
+    descriptorSets.resize(levels);
+    result = vkAllocateDescriptorSets(BP->device, &allocInfo, descriptorSets.data());
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw runtime_error("failed to allocate depth pyramid descriptor sets!");
+    }
+
+    for (uint32_t i = 0; i < levels; i++) {
+        VkDescriptorImageInfo sourceInfo{};
+        sourceInfo.sampler = texture.textureSampler;
+        sourceInfo.imageView = i == 0 ? BP->depthImageView : levelViews[i - 1];
+        sourceInfo.imageLayout = i == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+                                        : VK_IMAGE_LAYOUT_GENERAL;
+        VkDescriptorImageInfo destinationInfo{};
+        destinationInfo.imageView = levelViews[i];
+        destinationInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        array<VkWriteDescriptorSet, 2> writes{};
+        writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[0].dstSet = descriptorSets[i];
+        writes[0].dstBinding = 0;
+        writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        writes[0].descriptorCount = 1;
+        writes[0].pImageInfo = &sourceInfo;
+        writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[1].dstSet = descriptorSets[i];
+        writes[1].dstBinding = 1;
+        writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        writes[1].descriptorCount = 1;
+        writes[1].pImageInfo = &destinationInfo;
+        vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(writes.size()),
+                               writes.data(), 0, nullptr);
+    }
+}
+
+// Recorded after the first render pass, which leaves the depth attachment in
+// SHADER_READ_ONLY_OPTIMAL layout. The pyramid is left in the same layout.
+void DepthPyramid::record(VkCommandBuffer commandBuffer) {
+    // its old content is not needed: the culling reads are done by now
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = levels;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, reducePipeline.computePipeline);
+
+    // only the rendered part of the depth buffer, see BaseProject::renderExtent
+    uint32_t sizes[4] = {BP->renderExtent.width, BP->renderExtent.height, width, height};
+    for (uint32_t i = 0; i < levels; i++) {
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                reducePipeline.pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
+        vkCmdPushConstants(commandBuffer, reducePipeline.pipelineLayout,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(sizes), sizes);
+        vkCmdDispatch(commandBuffer, (sizes[2] + 7) / 8, (sizes[3] + 7) / 8, 1);
+
+        // the next level reads this one
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.subresourceRange.baseMipLevel = i;
+        barrier.subresourceRange.levelCount = 1;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+
+        sizes[0] = sizes[2];
+        sizes[1] = sizes[3];
+        sizes[2] = std::max(sizes[2] / 2, 1u);
+        sizes[3] = std::max(sizes[3] / 2, 1u);
+    }
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = levels;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &barrier);
+
+    built = true;
+}
+
+void DepthPyramid::cleanup() {
+    vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+    reducePipeline.cleanup();
+    DSL.cleanup();
+    for (auto view : levelViews) {
+        vkDestroyImageView(BP->device, view, nullptr);
+    }
+    texture.cleanup();
+}
+
 void DescriptorSetLayout::init(BaseProject *bp, vector<DescriptorSetLayoutBinding> B) {
     BP = bp;
 
@@ -2528,10 +5133,10 @@ void DescriptorSetSkyBox::init(BaseProject *bp, DescriptorSetLayout *DSL,
     toFree.resize(E.size());
 
     for (int j = 0; j < E.size(); j++) {
-        uniformBuffers[j].resize(BP->swapChainImages.size());
-        uniformBuffersMemory[j].resize(BP->swapChainImages.size());
+        uniformBuffers[j].resize(BP->framesInFlight);
+        uniformBuffersMemory[j].resize(BP->framesInFlight);
         if (E[j].type == UNIFORM) {
-            for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+            for (size_t i = 0; i < BP->framesInFlight; i++) {
                 VkDeviceSize bufferSize = E[j].size;
                 BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -2545,15 +5150,15 @@ void DescriptorSetSkyBox::init(BaseProject *bp, DescriptorSetLayout *DSL,
     }
 
     // Create Descriptor set
-    vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
+    vector<VkDescriptorSetLayout> layouts(BP->framesInFlight,
                                           DSL->descriptorSetLayout);
     VkDescriptorSetAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocInfo.descriptorPool = BP->descriptorPool;
-    allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->framesInFlight);
     allocInfo.pSetLayouts = layouts.data();
 
-    descriptorSets.resize(BP->swapChainImages.size());
+    descriptorSets.resize(BP->framesInFlight);
 
     VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
                                                descriptorSets.data());
@@ -2562,7 +5167,7 @@ void DescriptorSetSkyBox::init(BaseProject *bp, DescriptorSetLayout *DSL,
         throw runtime_error("SKYBOX: failed to allocate descriptor sets!");
     }
 
-    for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+    for (size_t i = 0; i < BP->framesInFlight; i++) {
         vector<VkWriteDescriptorSet> descriptorWrites(E.size());
         for (int j = 0; j < E.size(); j++) {
             if (E[j].type == UNIFORM) {
@@ -2603,7 +5208,7 @@ void DescriptorSetSkyBox::init(BaseProject *bp, DescriptorSetLayout *DSL,
 void DescriptorSetSkyBox::cleanup() {
     for (int j = 0; j < uniformBuffers.size(); j++) {
         if (toFree[j]) {
-            for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+            for (size_t i = 0; i < BP->framesInFlight; i++) {
                 vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
                 vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
             }
@@ -2621,10 +5226,10 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
     toFree.resize(E.size());
 
     for (int j = 0; j < E.size(); j++) {
-        uniformBuffers[j].resize(BP->swapChainImages.size());
-        uniformBuffersMemory[j].resize(BP->swapChainImages.size());
+        uniformBuffers[j].resize(BP->framesInFlight);
+        uniformBuffersMemory[j].resize(BP->framesInFlight);
         if (E[j].type == UNIFORM) {
-            for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+            for (size_t i = 0; i < BP->framesInFlight; i++) {
                 VkDeviceSize bufferSize = E[j].size;
                 BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -2632,21 +5237,33 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                                  uniformBuffers[j][i], uniformBuffersMemory[j][i]);
             }
             toFree[j] = true;
+        } else if (E[j].type == STORAGE) {
+            for (size_t i = 0; i < BP->framesInFlight; i++) {
+                VkDeviceSize bufferSize = E[j].size;
+                BP->createBuffer(bufferSize,
+                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+            }
+            toFree[j] = true;
         } else {
             toFree[j] = false;
         }
     }
 
     // Create Descriptor set
-    vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
+    vector<VkDescriptorSetLayout> layouts(BP->framesInFlight,
                                           DSL->descriptorSetLayout);
     VkDescriptorSetAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocInfo.descriptorPool = BP->descriptorPool;
-    allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->framesInFlight);
     allocInfo.pSetLayouts = layouts.data();
 
-    descriptorSets.resize(BP->swapChainImages.size());
+    descriptorSets.resize(BP->framesInFlight);
 
     VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
                                                descriptorSets.data());
@@ -2655,11 +5272,14 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
         throw runtime_error("OTHERS: failed to allocate descriptor sets!");
     }
 
-    for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+    for (size_t i = 0; i < BP->framesInFlight; i++) {
         vector<VkWriteDescriptorSet> descriptorWrites(E.size());
+        // the infos must outlive the loop, until vkUpdateDescriptorSets
+        vector<VkDescriptorBufferInfo> bufferInfos(E.size());
+        vector<VkDescriptorImageInfo> imageInfos(E.size());
         for (int j = 0; j < E.size(); j++) {
-            if (E[j].type == UNIFORM) {
-                VkDescriptorBufferInfo bufferInfo{};
+            if (E[j].type == UNIFORM || E[j].type == STORAGE) {
+                VkDescriptorBufferInfo &bufferInfo = bufferInfos[j];
                 bufferInfo.buffer = uniformBuffers[j][i];
                 bufferInfo.offset = 0;
                 bufferInfo.range = E[j].size;
@@ -2668,11 +5288,13 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                 descriptorWrites[j].dstSet = descriptorSets[i];
                 descriptorWrites[j].dstBinding = E[j].binding;
                 descriptorWrites[j].dstArrayElement = 0;
-                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                descriptorWrites[j].descriptorType = E[j].type == UNIFORM
+                                                         ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+                                                         : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
                 descriptorWrites[j].descriptorCount = 1;
                 descriptorWrites[j].pBufferInfo = &bufferInfo;
             } else if (E[j].type == TEXTURE) {
-                VkDescriptorImageInfo imageInfo{};
+                VkDescriptorImageInfo &imageInfo = imageInfos[j];
                 imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
                 imageInfo.imageView = E[j].tex->textureImageView;
                 imageInfo.sampler = E[j].tex->textureSampler;
@@ -2693,13 +5315,1121 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
     }
 }
 
+void DescriptorSet::writeTexture(int binding, Texture *tex) {
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageInfo.imageView = tex->textureImageView;
+    imageInfo.sampler = tex->textureSampler;
+
+    for (size_t i = 0; i < descriptorSets.size(); i++) {
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = descriptorSets[i];
+        descriptorWrite.dstBinding = binding;
+        descriptorWrite.dstArrayElement = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pImageInfo = &imageInfo;
+        vkUpdateDescriptorSets(BP->device, 1, &descriptorWrite, 0, nullptr);
+    }
+}
+
 void DescriptorSet::cleanup() {
     for (int j = 0; j < uniformBuffers.size(); j++) {
         if (toFree[j]) {
-            for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+            for (size_t i = 0; i < BP->framesInFlight; i++) {
                 vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
                 vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
             }
         }
     }
 }
+
+void *FrameArena::allocate(size_t bytes, size_t align) {
+    uintptr_t base = reinterpret_cast<uintptr_t>(block.get());
+    size_t start = ((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+    if (block && start + bytes <= size) {
+        offset = start + bytes;
+        return block.get() + start;
+    }
+    overflow.emplace_back(new unsigned char[bytes + align]);
+    overflowBytes += bytes + align;
+    uintptr_t p = reinterpret_cast<uintptr_t>(overflow.back().get());
+    return reinterpret_cast<void *>((p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+// The new block holds everything the last frame asked for
+void FrameArena::reset() {
+    if (!overflow.empty()) {
+        size += overflowBytes;
+        block.reset(new unsigned char[size]);
+        overflow.clear();
+        overflowBytes = 0;
+    }
+    offset = 0;
+}
+
+void RenderQueueStats::add(const RenderQueueStats &other) {
+    pipelineBinds += other.pipelineBinds;
+    descriptorSetBinds += other.descriptorSetBinds;
+    bufferBinds += other.bufferBinds;
+    draws += other.draws;
+}
+
+uint64_t RenderQueue::makeKey(uint32_t pass, uint32_t pipeline, uint32_t material,
+                              uint32_t mesh, uint32_t depth) {
+    return (static_cast<uint64_t>(pass & 0x3) << 62) |
+           (static_cast<uint64_t>(pipeline & 0xFF) << 54) |
+           (static_cast<uint64_t>(material & 0xFFF) << 42) |
+           (static_cast<uint64_t>(mesh & 0x3FF) << 32) |
+           (static_cast<uint64_t>(depth & 0xFFFFFF) << 8);
+}
+
+// Maps a view space distance to 24 bits, 0 at the near plane
+uint32_t RenderQueue::quantizeDepth(float viewDepth, float nearPlane, float farPlane) {
+    float d = (viewDepth - nearPlane) / (farPlane - nearPlane);
+    d = std::min(std::max(d, 0.0f), 1.0f);
+    return static_cast<uint32_t>(d * 0xFFFFFF);
+}
+
+size_t RenderQueue::passBegin(uint32_t pass) const {
+    uint64_t firstKey = makeKey(pass, 0, 0, 0, 0);
+    return std::lower_bound(keys.begin(), keys.end(), firstKey) - keys.begin();
+}
+
+void RenderQueue::clear() {
+    commands.clear();
+}
+
+void RenderQueue::submit(const DrawCommand &command) {
+    commands.push_back(command);
+}
+
+// LSD radix sort on the keys, one byte per pass. Passes where every key has
+// the same byte (e.g. the unused low byte) are skipped.
+void RenderQueue::sort(FrameArena &arena) {
+    size_t n = commands.size();
+    keys.resize(n);
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = commands[i].key;
+        order[i] = static_cast<uint32_t>(i);
+    }
+    if (n < 2) {
+        return;
+    }
+
+    uint64_t *srcKeys = keys.data();
+    uint32_t *srcOrder = order.data();
+    uint64_t *dstKeys = arena.allocate<uint64_t>(n);
+    uint32_t *dstOrder = arena.allocate<uint32_t>(n);
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[256] = {0};
+        for (size_t i = 0; i < n; i++) {
+            count[(srcKeys[i] >> shift) & 0xFF]++;
+        }
+        if (count[(srcKeys[0] >> shift) & 0xFF] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t dst = count[(srcKeys[i] >> shift) & 0xFF]++;
+            dstKeys[dst] = srcKeys[i];
+            dstOrder[dst] = srcOrder[i];
+        }
+        std::swap(srcKeys, dstKeys);
+        std::swap(srcOrder, dstOrder);
+    }
+    // an odd number of passes leaves the result in the arena
+    if (srcKeys != keys.data()) {
+        std::copy(srcKeys, srcKeys + n, keys.begin());
+        std::copy(srcOrder, srcOrder + n, order.begin());
+    }
+}
+
+// Records the sorted draws [begin, end), binding only what changed since the
+// previous draw. Each call starts from an empty binding state, as a secondary
+// command buffer inherits nothing.
+void RenderQueue::replay(VkCommandBuffer commandBuffer, size_t begin, size_t end,
+                         RenderQueueStats &stats) const {
+    const Pipeline *boundPipeline = nullptr;
+    VkDescriptorSet boundSets[3] = {VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE};
+    VkBuffer boundVertexBuffer = VK_NULL_HANDLE;
+    VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+
+    for (size_t i = begin; i < end; i++) {
+        const DrawCommand &command = commands[order[i]];
+
+        if (command.pipeline != boundPipeline) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              command.pipeline->graphicsPipeline);
+            // sets bound with another layout cannot be relied upon
+            if (boundPipeline == nullptr ||
+                boundPipeline->pipelineLayout != command.pipeline->pipelineLayout) {
+                boundSets[0] = VK_NULL_HANDLE;
+                boundSets[1] = VK_NULL_HANDLE;
+                boundSets[2] = VK_NULL_HANDLE;
+            }
+            boundPipeline = command.pipeline;
+            stats.pipelineBinds++;
+        }
+
+        for (uint32_t set = 0; set < command.setCount; set++) {
+            if (command.sets[set] != boundSets[set]) {
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                        command.pipeline->pipelineLayout, set, 1,
+                                        &command.sets[set], 0, nullptr);
+                boundSets[set] = command.sets[set];
+                stats.descriptorSetBinds++;
+            }
+        }
+
+        if (command.vertexBuffer != boundVertexBuffer) {
+            VkDeviceSize offsets[] = {0};
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &command.vertexBuffer, offsets);
+            boundVertexBuffer = command.vertexBuffer;
+            stats.bufferBinds++;
+        }
+        if (command.indexBuffer != boundIndexBuffer) {
+            vkCmdBindIndexBuffer(commandBuffer, command.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+            boundIndexBuffer = command.indexBuffer;
+            stats.bufferBinds++;
+        }
+
+        if (command.indirectBuffer == VK_NULL_HANDLE) {
+            vkCmdDrawIndexed(commandBuffer, command.indexCount, 1, 0, 0, 0);
+        } else if (drawIndirectCount) {
+            vkCmdDrawIndexedIndirectCount(commandBuffer, command.indirectBuffer, command.indirectOffset,
+                                          command.countBuffer, command.countOffset,
+                                          command.maxDrawCount, sizeof(VkDrawIndexedIndirectCommand));
+        } else if (multiDrawIndirect) {
+            // unused commands are zero-filled, so they draw nothing
+            vkCmdDrawIndexedIndirect(commandBuffer, command.indirectBuffer, command.indirectOffset,
+                                     command.maxDrawCount, sizeof(VkDrawIndexedIndirectCommand));
+        } else {
+            for (uint32_t d = 0; d < command.maxDrawCount; d++) {
+                vkCmdDrawIndexedIndirect(commandBuffer, command.indirectBuffer,
+                                         command.indirectOffset + d * sizeof(VkDrawIndexedIndirectCommand),
+                                         1, sizeof(VkDrawIndexedIndirectCommand));
+            }
+        }
+        stats.draws++;
+    }
+}
+
+Frustum Frustum::fromMatrix(const glm::mat4 &viewProj) {
+    // rows of the matrix (glm is column major)
+    glm::vec4 r[4];
+    for (int i = 0; i < 4; i++) {
+        r[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+    }
+
+    Frustum f;
+    f.planes[0] = r[3] + r[0];
+    f.planes[1] = r[3] - r[0];
+    f.planes[2] = r[3] + r[1];
+    f.planes[3] = r[3] - r[1];
+    f.planes[4] = r[2];  // depth range is [0, 1]
+    f.planes[5] = r[3] - r[2];
+    for (auto &plane : f.planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return f;
+}
+
+void Frustum::cull(const std::vector<glm::vec4> &spheres, std::vector<uint32_t> &visible) const {
+    size_t count = spheres.size();
+    size_t i = 0;
+
+#if HAS_SSE
+    // Four spheres per iteration, transposed to x, y, z, radius registers
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(&spheres[i].x);
+        __m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+        __m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+        __m128 r = _mm_loadu_ps(&spheres[i + 3].x);
+        _MM_TRANSPOSE4_PS(x, y, z, r);
+        __m128 negR = _mm_sub_ps(_mm_setzero_ps(), r);
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (const auto &plane : planes) {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)),
+                                             _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+                                  _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)),
+                                             _mm_set1_ps(plane.w)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negR));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; lane++) {
+            if (mask & (1 << lane)) {
+                visible.push_back(static_cast<uint32_t>(i + lane));
+            }
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        const glm::vec4 &sphere = spheres[i];
+        bool inside = true;
+        for (const auto &plane : planes) {
+            if (glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w < -sphere.w) {
+                inside = false;
+                break;
+            }
+        }
+        if (inside) {
+            visible.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+void Footprint::compute(const std::vector<Vertex> &vertices) {
+    min = max = glm::vec4(0.0f);
+    for (size_t i = 0; i < vertices.size(); i++) {
+        const glm::vec3 &p = vertices[i].pos;
+        glm::vec4 extents(p.x, p.z, p.x + p.z, p.x - p.z);
+        min = i == 0 ? extents : glm::min(min, extents);
+        max = i == 0 ? extents : glm::max(max, extents);
+    }
+}
+
+void Footprint::place(float scale, float angle, glm::vec2 offset, WorldFootprint &world) const {
+    // Each corner is where two consecutive slabs meet: the bounds are tight,
+    // so some of them may coincide, which leaves the octagon convex
+    const glm::vec2 corners[8] = {{max.x, max.x - max.w}, {max.x, max.z - max.x},
+                                  {max.z - max.y, max.y}, {min.w + max.y, max.y},
+                                  {min.x, min.x - min.w}, {min.x, min.z - min.x},
+                                  {min.z - min.y, min.y}, {max.w + min.y, min.y}};
+    const glm::vec2 normals[4] = {{1.0f, 0.0f}, {0.0f, 1.0f}, {1.0f, 1.0f}, {1.0f, -1.0f}};
+
+    // rotation around y, as glm::rotate
+    float c = cos(angle), s = sin(angle);
+    for (int i = 0; i < 8; i++) {
+        world.x[i] = scale * (c * corners[i].x + s * corners[i].y + offset.x);
+        world.z[i] = scale * (c * corners[i].y - s * corners[i].x + offset.y);
+    }
+    // the scale is uniform, the normals only turn, and the corners project
+    // on them to the bounds of the slabs
+    for (int i = 0; i < 4; i++) {
+        world.axisX[i] = c * normals[i].x + s * normals[i].y;
+        world.axisZ[i] = c * normals[i].y - s * normals[i].x;
+        float shift = world.axisX[i] * offset.x + world.axisZ[i] * offset.y;
+        world.low[i] = scale * (min[i] + shift);
+        world.high[i] = scale * (max[i] + shift);
+    }
+}
+
+float Footprint::reach() const {
+    WorldFootprint local;
+    place(1.0f, 0.0f, glm::vec2(0.0f), local);
+    float reach2 = 0.0f;
+    for (int i = 0; i < 8; i++) {
+        reach2 = std::max(reach2, local.x[i] * local.x[i] + local.z[i] * local.z[i]);
+    }
+    return sqrt(reach2);
+}
+
+#if HAS_SSE
+// Bounds of the projections of the corners of f on 4 axes
+static inline void ProjectFootprint(const WorldFootprint &f, __m128 nx, __m128 nz,
+                                    __m128 &lo, __m128 &hi) {
+    lo = hi = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.x[0]), nx), _mm_mul_ps(_mm_set1_ps(f.z[0]), nz));
+    for (int i = 1; i < 8; i++) {
+        __m128 d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.x[i]), nx), _mm_mul_ps(_mm_set1_ps(f.z[i]), nz));
+        lo = _mm_min_ps(lo, d);
+        hi = _mm_max_ps(hi, d);
+    }
+}
+#endif
+
+bool FootprintsOverlap(const WorldFootprint &a, const WorldFootprint &b) {
+    // the axes of a first, then the ones of b
+    const WorldFootprint *owners[2] = {&a, &b};
+    const WorldFootprint *others[2] = {&b, &a};
+    for (int k = 0; k < 2; k++) {
+        const WorldFootprint &owner = *owners[k];
+        const WorldFootprint &other = *others[k];
+#if HAS_SSE
+        __m128 lo, hi;
+        ProjectFootprint(other, _mm_loadu_ps(owner.axisX), _mm_loadu_ps(owner.axisZ), lo, hi);
+        __m128 apart = _mm_or_ps(_mm_cmplt_ps(hi, _mm_loadu_ps(owner.low)),
+                                 _mm_cmplt_ps(_mm_loadu_ps(owner.high), lo));
+        if (_mm_movemask_ps(apart)) {
+            return false;
+        }
+#else
+        for (int axis = 0; axis < 4; axis++) {
+            float nx = owner.axisX[axis], nz = owner.axisZ[axis];
+            float lo = other.x[0] * nx + other.z[0] * nz, hi = lo;
+            for (int i = 1; i < 8; i++) {
+                float d = other.x[i] * nx + other.z[i] * nz;
+                lo = std::min(lo, d);
+                hi = std::max(hi, d);
+            }
+            if (hi < owner.low[axis] || owner.high[axis] < lo) {
+                return false;
+            }
+        }
+#endif
+    }
+    return true;
+}
+
+bool FootprintsSweep(const WorldFootprint &a, const WorldFootprint &b, glm::vec2 motion, float &time) {
+    const float infinity = std::numeric_limits<float>::infinity();
+    const WorldFootprint *owners[2] = {&a, &b};
+    const WorldFootprint *others[2] = {&b, &a};
+    // on the axes of b it is a that moves, the other way
+    const float directions[2] = {1.0f, -1.0f};
+    float enter = 0.0f, leave = 1.0f;
+#if HAS_SSE
+    __m128 enters = _mm_set1_ps(enter), leaves = _mm_set1_ps(leave);
+#endif
+    for (int k = 0; k < 2; k++) {
+        const WorldFootprint &owner = *owners[k];
+        const WorldFootprint &other = *others[k];
+        glm::vec2 move = motion * directions[k];
+#if HAS_SSE
+        __m128 nx = _mm_loadu_ps(owner.axisX), nz = _mm_loadu_ps(owner.axisZ);
+        __m128 low = _mm_loadu_ps(owner.low), high = _mm_loadu_ps(owner.high);
+        __m128 lo, hi;
+        ProjectFootprint(other, nx, nz, lo, hi);
+        __m128 speed = _mm_add_ps(_mm_mul_ps(nx, _mm_set1_ps(move.x)), _mm_mul_ps(nz, _mm_set1_ps(move.y)));
+        // [lo, hi] + speed * t meets [low, high] from t1 to t2 (or t2 to t1)
+        __m128 t1 = _mm_div_ps(_mm_sub_ps(low, hi), speed);
+        __m128 t2 = _mm_div_ps(_mm_sub_ps(high, lo), speed);
+        __m128 first = _mm_min_ps(t1, t2), last = _mm_max_ps(t1, t2);
+        // not moving along the axis: touching for the whole step or never
+        __m128 still = _mm_cmpeq_ps(speed, _mm_setzero_ps());
+        __m128 touching = _mm_and_ps(_mm_cmple_ps(lo, high), _mm_cmple_ps(low, hi));
+        __m128 always = _mm_and_ps(still, touching), never = _mm_andnot_ps(touching, still);
+        __m128 inf = _mm_set1_ps(infinity);
+        first = _mm_andnot_ps(still, first);
+        first = _mm_or_ps(first, _mm_and_ps(always, _mm_sub_ps(_mm_setzero_ps(), inf)));
+        first = _mm_or_ps(first, _mm_and_ps(never, inf));
+        last = _mm_andnot_ps(still, last);
+        last = _mm_or_ps(last, _mm_and_ps(always, inf));
+        last = _mm_or_ps(last, _mm_and_ps(never, _mm_sub_ps(_mm_setzero_ps(), inf)));
+        enters = _mm_max_ps(enters, first);
+        leaves = _mm_min_ps(leaves, last);
+#else
+        for (int axis = 0; axis < 4; axis++) {
+            float nx = owner.axisX[axis], nz = owner.axisZ[axis];
+            float lo = other.x[0] * nx + other.z[0] * nz, hi = lo;
+            for (int i = 1; i < 8; i++) {
+                float d = other.x[i] * nx + other.z[i] * nz;
+                lo = std::min(lo, d);
+                hi = std::max(hi, d);
+            }
+            float speed = nx * move.x + nz * move.y;
+            if (speed == 0.0f) {
+                if (hi < owner.low[axis] || owner.high[axis] < lo) {
+                    return false;
+                }
+                continue;
+            }
+            float t1 = (owner.low[axis] - hi) / speed;
+            float t2 = (owner.high[axis] - lo) / speed;
+            enter = std::max(enter, std::min(t1, t2));
+            leave = std::min(leave, std::max(t1, t2));
+        }
+#endif
+    }
+#if HAS_SSE
+    enters = _mm_max_ps(enters, _mm_shuffle_ps(enters, enters, _MM_SHUFFLE(2, 3, 0, 1)));
+    enters = _mm_max_ps(enters, _mm_shuffle_ps(enters, enters, _MM_SHUFFLE(1, 0, 3, 2)));
+    leaves = _mm_min_ps(leaves, _mm_shuffle_ps(leaves, leaves, _MM_SHUFFLE(2, 3, 0, 1)));
+    leaves = _mm_min_ps(leaves, _mm_shuffle_ps(leaves, leaves, _MM_SHUFFLE(1, 0, 3, 2)));
+    enter = _mm_cvtss_f32(enters);
+    leave = _mm_cvtss_f32(leaves);
+#endif
+    if (enter > leave) {
+        return false;
+    }
+    time = enter;
+    return true;
+}
+
+void TransformSystem::init(size_t count, int framesInFlight) {
+    tx.assign(count, 0.0f);
+    ty.assign(count, 0.0f);
+    tz.assign(count, 0.0f);
+    qx.assign(count, 0.0f);
+    qy.assign(count, 0.0f);
+    qz.assign(count, 0.0f);
+    qw.assign(count, 1.0f);
+    sx.assign(count, 1.0f);
+    sy.assign(count, 1.0f);
+    sz.assign(count, 1.0f);
+    matrices.assign(count, glm::mat4(1.0f));
+    dirty.assign(count, 1);
+    stale.assign(count, 0);
+    allFrames = static_cast<uint8_t>((1 << framesInFlight) - 1);
+}
+
+// Setting a component to the value it already has leaves the object clean
+void TransformSystem::setTranslation(size_t i, glm::vec3 t) {
+    if (tx[i] != t.x || ty[i] != t.y || tz[i] != t.z) {
+        tx[i] = t.x;
+        ty[i] = t.y;
+        tz[i] = t.z;
+        dirty[i] = 1;
+    }
+}
+
+void TransformSystem::setRotation(size_t i, glm::quat q) {
+    if (qx[i] != q.x || qy[i] != q.y || qz[i] != q.z || qw[i] != q.w) {
+        qx[i] = q.x;
+        qy[i] = q.y;
+        qz[i] = q.z;
+        qw[i] = q.w;
+        dirty[i] = 1;
+    }
+}
+
+void TransformSystem::setScale(size_t i, glm::vec3 s) {
+    if (sx[i] != s.x || sy[i] != s.y || sz[i] != s.z) {
+        sx[i] = s.x;
+        sy[i] = s.y;
+        sz[i] = s.z;
+        dirty[i] = 1;
+    }
+}
+
+size_t TransformSystem::update() {
+    return update(0, size());
+}
+
+size_t TransformSystem::update(size_t begin, size_t end) {
+    size_t composed = 0;
+    size_t i = begin;
+#if HAS_SSE
+    // Groups of four with a dirty object are composed whole: the matrices
+    // of the clean ones come out the same, and are not made stale
+    for (; i + 4 <= end; i += 4) {
+        uint32_t flags;
+        memcpy(&flags, &dirty[i], sizeof(flags));
+        if (!flags) {
+            continue;
+        }
+        composeSSE(i);
+        for (size_t k = i; k < i + 4; k++) {
+            if (dirty[k]) {
+                dirty[k] = 0;
+                stale[k] = allFrames;
+                composed++;
+            }
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        if (dirty[i]) {
+            composeScalar(i);
+            dirty[i] = 0;
+            stale[i] = allFrames;
+            composed++;
+        }
+    }
+    return composed;
+}
+
+bool TransformSystem::takeStale(size_t i, uint32_t frame) {
+    uint8_t bit = static_cast<uint8_t>(1 << frame);
+    if (stale[i] & bit) {
+        stale[i] &= ~bit;
+        return true;
+    }
+    return false;
+}
+
+glm::mat4 TransformSystem::compose(glm::vec3 t, glm::quat q, glm::vec3 s) {
+    glm::mat4 m = glm::mat4_cast(q);
+    m[0] *= s.x;
+    m[1] *= s.y;
+    m[2] *= s.z;
+    m[3] = glm::vec4(t, 1.0f);
+    return m;
+}
+
+void TransformSystem::composeScalar(size_t i) {
+    matrices[i] = compose(glm::vec3(tx[i], ty[i], tz[i]), glm::quat(qw[i], qx[i], qy[i], qz[i]),
+                          glm::vec3(sx[i], sy[i], sz[i]));
+}
+
+#if HAS_SSE
+// Each register holds the same element of four matrices: every column is
+// transposed back to the four matrices before being stored
+void TransformSystem::composeSSE(size_t first) {
+    __m128 x = _mm_loadu_ps(&qx[first]), y = _mm_loadu_ps(&qy[first]);
+    __m128 z = _mm_loadu_ps(&qz[first]), w = _mm_loadu_ps(&qw[first]);
+    __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+
+    __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+    __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+    __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+    __m128 scales[3] = {_mm_loadu_ps(&sx[first]), _mm_loadu_ps(&sy[first]), _mm_loadu_ps(&sz[first])};
+    __m128 columns[4][4] = {
+        {_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), _mm_mul_ps(two, _mm_add_ps(xy, wz)),
+         _mm_mul_ps(two, _mm_sub_ps(xz, wy)), _mm_setzero_ps()},
+        {_mm_mul_ps(two, _mm_sub_ps(xy, wz)), _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))),
+         _mm_mul_ps(two, _mm_add_ps(yz, wx)), _mm_setzero_ps()},
+        {_mm_mul_ps(two, _mm_add_ps(xz, wy)), _mm_mul_ps(two, _mm_sub_ps(yz, wx)),
+         _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), _mm_setzero_ps()},
+        {_mm_loadu_ps(&tx[first]), _mm_loadu_ps(&ty[first]), _mm_loadu_ps(&tz[first]), one}};
+
+    for (int c = 0; c < 4; c++) {
+        __m128 r0 = columns[c][0], r1 = columns[c][1], r2 = columns[c][2], r3 = columns[c][3];
+        if (c < 3) {
+            r0 = _mm_mul_ps(r0, scales[c]);
+            r1 = _mm_mul_ps(r1, scales[c]);
+            r2 = _mm_mul_ps(r2, scales[c]);
+        }
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(&matrices[first][c].x, r0);
+        _mm_storeu_ps(&matrices[first + 1][c].x, r1);
+        _mm_storeu_ps(&matrices[first + 2][c].x, r2);
+        _mm_storeu_ps(&matrices[first + 3][c].x, r3);
+    }
+}
+#endif
+
+std::vector<ComponentType> &EntityWorld::componentTypes() {
+    static std::vector<ComponentType> types;
+    return types;
+}
+
+int EntityWorld::registerComponent(size_t size, size_t align) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<ComponentType> &types = componentTypes();
+    if (types.size() == 64) {
+        throw std::runtime_error("too many component types!");
+    }
+    types.push_back({size, align});
+    return (int)types.size() - 1;
+}
+
+const EntityWorld::Location &EntityWorld::location(Entity e) const {
+    if (!alive(e)) {
+        throw std::runtime_error("entity is not alive");
+    }
+    return locations[e.index];
+}
+
+bool EntityWorld::alive(Entity e) const {
+    return e.index < locations.size() && locations[e.index].archetype != nullptr &&
+           locations[e.index].generation == e.generation;
+}
+
+Entity EntityWorld::allocate() {
+    Entity e;
+    if (freeIndices.empty()) {
+        e.index = (uint32_t)locations.size();
+        locations.emplace_back();
+    } else {
+        e.index = freeIndices.back();
+        freeIndices.pop_back();
+    }
+    // a destroyed entity never matches the new one at its index
+    e.generation = ++locations[e.index].generation;
+    live++;
+    return e;
+}
+
+Archetype &EntityWorld::archetype(ComponentMask mask) {
+    auto found = byMask.find(mask);
+    if (found != byMask.end()) {
+        return *found->second;
+    }
+
+    archetypes.push_back(std::make_unique<Archetype>());
+    Archetype &a = *archetypes.back();
+    a.mask = mask;
+    a.column.fill(-1);
+    size_t entitySize = sizeof(Entity);
+    for (int id = 0; id < 64; id++) {
+        if ((mask >> id) & 1) {
+            a.column[id] = (int8_t)a.types.size();
+            a.types.push_back(id);
+            a.sizes.push_back(componentTypes()[id].size);
+            entitySize += componentTypes()[id].size;
+        }
+    }
+    // as many entities as fit with the padding between the arrays
+    for (a.capacity = EntityChunk::Size / entitySize; a.capacity > 0; a.capacity--) {
+        size_t offset = a.capacity * sizeof(Entity);
+        a.offsets.clear();
+        for (int id : a.types) {
+            const ComponentType &type = componentTypes()[id];
+            offset = (offset + type.align - 1) / type.align * type.align;
+            a.offsets.push_back(offset);
+            offset += a.capacity * type.size;
+        }
+        if (offset <= EntityChunk::Size) {
+            break;
+        }
+    }
+    if (a.capacity == 0) {
+        throw std::runtime_error("components of an entity do not fit in a chunk!");
+    }
+    byMask[mask] = &a;
+    return a;
+}
+
+size_t EntityWorld::append(Archetype &a, Entity e) {
+    size_t row = a.count++;
+    if (row / a.capacity == a.chunks.size()) {
+        a.chunks.push_back(std::make_unique<EntityChunk>());
+    }
+    a.entities(row / a.capacity)[row % a.capacity] = e;
+    locations[e.index].archetype = &a;
+    locations[e.index].row = row;
+    return row;
+}
+
+// The last entity of the archetype takes the place of the removed one. Empty
+// chunks are kept for the entities to come
+void EntityWorld::removeRow(Archetype &a, size_t row) {
+    size_t last = --a.count;
+    if (row == last) {
+        return;
+    }
+    Entity moved = a.entities(last / a.capacity)[last % a.capacity];
+    a.entities(row / a.capacity)[row % a.capacity] = moved;
+    for (size_t c = 0; c < a.types.size(); c++) {
+        memcpy(a.component(row, (int)c), a.component(last, (int)c), a.sizes[c]);
+    }
+    locations[moved.index].row = row;
+}
+
+void EntityWorld::destroy(Entity e) {
+    Location l = location(e);
+    removeRow(*l.archetype, l.row);
+    locations[e.index].archetype = nullptr;
+    freeIndices.push_back(e.index);
+    live--;
+}
+
+void EntityWorld::clear() {
+    for (const auto &a : archetypes) {
+        a->count = 0;
+    }
+    for (uint32_t i = 0; i < locations.size(); i++) {
+        if (locations[i].archetype != nullptr) {
+            locations[i].archetype = nullptr;
+            freeIndices.push_back(i);
+        }
+    }
+    live = 0;
+}
+
+// Copies the components the entity keeps to the archetype of mask, the
+// added one is left for add() to write
+void EntityWorld::move(Entity e, ComponentMask mask) {
+    Location from = location(e);
+    Archetype &to = archetype(mask);
+    size_t row = append(to, e);
+    for (size_t c = 0; c < to.types.size(); c++) {
+        int column = from.archetype->column[to.types[c]];
+        if (column >= 0) {
+            memcpy(to.component(row, (int)c), from.archetype->component(from.row, column), to.sizes[c]);
+        }
+    }
+    removeRow(*from.archetype, from.row);
+}
+
+// Chase-Lev work-stealing deque, with the memory orders of Le, Pop, Cohen
+// and Zappa Nardelli (PPoPP 2013)
+bool WorkStealingDeque::push(Job *job) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= Capacity) {
+        return false;
+    }
+    items[b & (Capacity - 1)].store(job, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+Job *WorkStealingDeque::pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+        // empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    Job *job = items[b & (Capacity - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+        // the last job: a thief may be taking it as well
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            job = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return job;
+}
+
+Job *WorkStealingDeque::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return nullptr;
+    }
+    Job *job = items[t & (Capacity - 1)].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+        return nullptr;  // lost the race
+    }
+    return job;
+}
+
+void JobSystem::start(int count) {
+    if (count <= 0) {
+        count = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    }
+    quit = false;
+    startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        workers.push_back(std::make_unique<JobWorker>());
+    }
+    // the deques have to exist before any worker can steal from them
+    for (int i = 0; i < count; i++) {
+        workers[i]->thread = std::thread(&JobSystem::workerLoop, this, i);
+    }
+}
+
+void JobSystem::stop() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        quit = true;
+    }
+    wakeCondition.notify_all();
+    for (auto &worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void JobSystem::schedule(Job &job, JobCounter &counter, JobCounter *dependency) {
+    job.counter = &counter;
+    counter.pending.fetch_add(1);
+    if (dependency != nullptr) {
+        std::lock_guard<std::mutex> lock(dependency->mutex);
+        if (dependency->pending.load() > 0) {
+            dependency->waiting.push_back(&job);
+            return;
+        }
+    }
+    submit(&job);
+}
+
+void JobSystem::submit(Job *job) {
+    if (workerIndex < 0 || !workers[workerIndex]->deque.push(job)) {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        if (sharedCount == shared.size()) {
+            // unrolled into a ring twice as large
+            std::rotate(shared.begin(), shared.begin() + sharedHead, shared.end());
+            shared.resize(std::max<size_t>(64, 2 * shared.size()));
+            sharedHead = 0;
+        }
+        shared[(sharedHead + sharedCount++) % shared.size()] = job;
+    }
+    queued.fetch_add(1);
+    // a worker going to sleep either sees the new job or gets the notification
+    if (sleeping.load() > 0) {
+        { std::lock_guard<std::mutex> lock(sleepMutex); }
+        wakeCondition.notify_one();
+    }
+}
+
+// Own jobs first (the most recent, still in cache), then the shared queue,
+// then the oldest jobs of the other workers
+Job *JobSystem::findJob() {
+    Job *job = nullptr;
+    if (workerIndex >= 0) {
+        job = workers[workerIndex]->deque.pop();
+    }
+    if (job == nullptr && queued.load() > 0) {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        if (sharedCount > 0) {
+            job = shared[sharedHead];
+            sharedHead = (sharedHead + 1) % shared.size();
+            sharedCount--;
+        }
+    }
+    if (job == nullptr && queued.load() > 0) {
+        int count = (int)workers.size();
+        for (int i = 1; i <= count && job == nullptr; i++) {
+            int victim = (std::max(workerIndex, 0) + i) % count;
+            if (victim != workerIndex) {
+                job = workers[victim]->deque.steal();
+            }
+        }
+        if (job != nullptr && workerIndex >= 0) {
+            workers[workerIndex]->jobsStolen.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (job != nullptr) {
+        queued.fetch_sub(1);
+    }
+    return job;
+}
+
+void JobSystem::execute(Job *job) {
+    auto start = std::chrono::steady_clock::now();
+    JobCounter &counter = *job->counter;
+    try {
+        job->function(job->data, job->begin, job->end);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(counter.mutex);
+        if (!counter.error) {
+            counter.error = std::current_exception();
+        }
+    }
+    if (workerIndex >= 0) {
+        JobWorker &worker = *workers[workerIndex];
+        worker.busyTime.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count(),
+                                  std::memory_order_relaxed);
+        worker.jobsRun.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        helperJobs.fetch_add(1, std::memory_order_relaxed);
+    }
+    finish(counter);
+}
+
+// The counter is only touched under its mutex: wait() takes it before
+// returning, so the counter (often on the stack of the waiting thread) is
+// still there until the last job is done with it
+void JobSystem::finish(JobCounter &counter) {
+    std::vector<Job *> ready;
+    {
+        std::lock_guard<std::mutex> lock(counter.mutex);
+        if (counter.pending.fetch_sub(1) == 1) {
+            ready.swap(counter.waiting);
+        }
+    }
+    for (Job *job : ready) {
+        submit(job);
+    }
+}
+
+void JobSystem::wait(JobCounter &counter) {
+    while (counter.pending.load() > 0) {
+        Job *job = findJob();
+        if (job != nullptr) {
+            execute(job);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    std::lock_guard<std::mutex> lock(counter.mutex);
+    if (counter.error) {
+        std::exception_ptr error = counter.error;
+        counter.error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void JobSystem::workerLoop(int index) {
+    workerIndex = index;
+    while (!quit) {
+        Job *job = findJob();
+        if (job != nullptr) {
+            execute(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleeping.fetch_add(1);
+        wakeCondition.wait(lock, [&] { return quit || queued.load() > 0; });
+        sleeping.fetch_sub(1);
+    }
+}
+
+double JobSystem::utilization() const {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (workers.empty() || elapsed <= 0.0) {
+        return 0.0;
+    }
+    uint64_t busy = 0;
+    for (const auto &worker : workers) {
+        busy += worker->busyTime.load(std::memory_order_relaxed);
+    }
+    return busy * 1e-9 / (elapsed * workers.size());
+}
+
+uint64_t JobSystem::jobsRun() const {
+    uint64_t run = helperJobs.load(std::memory_order_relaxed);
+    for (const auto &worker : workers) {
+        run += worker->jobsRun.load(std::memory_order_relaxed);
+    }
+    return run;
+}
+
+uint64_t JobSystem::jobsStolen() const {
+    uint64_t stolen = 0;
+    for (const auto &worker : workers) {
+        stolen += worker->jobsStolen.load(std::memory_order_relaxed);
+    }
+    return stolen;
+}
+
+static inline uint64_t RotateLeft(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+Random::Random(uint64_t seed) {
+    for (uint64_t &word : s) {
+        // splitmix64
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        word = z ^ (z >> 31);
+    }
+}
+
+uint64_t Random::next() {
+    uint64_t result = RotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = RotateLeft(s[3], 45);
+    return result;
+}
+
+float Random::uniform(float low, float high) {
+    float u = (float)(next() >> 40) * (1.0f / 16777216.0f);
+    return low + u * (high - low);
+}
+
+// Lemire's multiply and shift, the bias (below 2^-32) is not worth a loop
+uint32_t Random::below(uint32_t n) {
+    return (uint32_t)(((next() >> 32) * n) >> 32);
+}
+
+void Random::jump() {
+    static const uint64_t polynomial[4] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                           0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+    uint64_t jumped[4] = {0, 0, 0, 0};
+    for (uint64_t word : polynomial) {
+        for (int b = 0; b < 64; b++) {
+            if (word & (uint64_t(1) << b)) {
+                for (int i = 0; i < 4; i++) {
+                    jumped[i] ^= s[i];
+                }
+            }
+            next();
+        }
+    }
+    memcpy(s, jumped, sizeof(s));
+}
+
+Random Random::stream(uint64_t seed, uint32_t n) {
+    Random random(seed);
+    for (uint32_t i = 0; i < n; i++) {
+        random.jump();
+    }
+    return random;
+}
+
+RandomBatch::RandomBatch(Random random) {
+    for (int stream = 0; stream < 4; stream++) {
+        random.jump();
+        for (int word = 0; word < 4; word++) {
+            s[word][stream] = random.s[word];
+        }
+    }
+}
+
+void RandomBatch::fill(float *out, size_t count, float low, float high) {
+#if HAS_SSE
+    fillSSE(out, count / 4, low, high);
+#else
+    fillScalar(out, count / 4, low, high);
+#endif
+    if (count % 4) {
+        float last[4];
+        fillScalar(last, 1, low, high);
+        memcpy(out + count / 4 * 4, last, count % 4 * sizeof(float));
+    }
+}
+
+void RandomBatch::fillScalar(float *out, size_t groups, float low, float high) {
+    for (size_t g = 0; g < groups; g++) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t result = RotateLeft(s[1][i] * 5, 7) * 9;
+            uint64_t t = s[1][i] << 17;
+            s[2][i] ^= s[0][i];
+            s[3][i] ^= s[1][i];
+            s[1][i] ^= s[2][i];
+            s[0][i] ^= s[3][i];
+            s[2][i] ^= t;
+            s[3][i] = RotateLeft(s[3][i], 45);
+            float u = (float)(result >> 40) * (1.0f / 16777216.0f);
+            out[g * 4 + i] = low + u * (high - low);
+        }
+    }
+}
+
+#if HAS_SSE
+// Two registers of two streams: SSE2 has 64-bit shifts and adds, the
+// multiplications by 5 and 9 are a shift and an add
+void RandomBatch::fillSSE(float *out, size_t groups, float low, float high) {
+    __m128i s0[2], s1[2], s2[2], s3[2];
+    for (int h = 0; h < 2; h++) {
+        s0[h] = _mm_load_si128(reinterpret_cast<const __m128i *>(&s[0][h * 2]));
+        s1[h] = _mm_load_si128(reinterpret_cast<const __m128i *>(&s[1][h * 2]));
+        s2[h] = _mm_load_si128(reinterpret_cast<const __m128i *>(&s[2][h * 2]));
+        s3[h] = _mm_load_si128(reinterpret_cast<const __m128i *>(&s[3][h * 2]));
+    }
+    __m128 scale = _mm_set1_ps(1.0f / 16777216.0f);
+    __m128 range = _mm_set1_ps(high - low), offset = _mm_set1_ps(low);
+
+    for (size_t g = 0; g < groups; g++) {
+        __m128i bits[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i x = _mm_add_epi64(_mm_slli_epi64(s1[h], 2), s1[h]);  // * 5
+            x = _mm_or_si128(_mm_slli_epi64(x, 7), _mm_srli_epi64(x, 57));
+            x = _mm_add_epi64(_mm_slli_epi64(x, 3), x);  // * 9
+            // the top 24 bits, in the low half of each lane
+            bits[h] = _mm_shuffle_epi32(_mm_srli_epi64(x, 40), _MM_SHUFFLE(3, 1, 2, 0));
+
+            __m128i t = _mm_slli_epi64(s1[h], 17);
+            s2[h] = _mm_xor_si128(s2[h], s0[h]);
+            s3[h] = _mm_xor_si128(s3[h], s1[h]);
+            s1[h] = _mm_xor_si128(s1[h], s2[h]);
+            s0[h] = _mm_xor_si128(s0[h], s3[h]);
+            s2[h] = _mm_xor_si128(s2[h], t);
+            s3[h] = _mm_or_si128(_mm_slli_epi64(s3[h], 45), _mm_srli_epi64(s3[h], 19));
+        }
+        __m128 u = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi64(bits[0], bits[1])), scale);
+        _mm_storeu_ps(out + g * 4, _mm_add_ps(offset, _mm_mul_ps(u, range)));
+    }
+
+    for (int h = 0; h < 2; h++) {
+        _mm_store_si128(reinterpret_cast<__m128i *>(&s[0][h * 2]), s0[h]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(&s[1][h * 2]), s1[h]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(&s[2][h * 2]), s2[h]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(&s[3][h * 2]), s3[h]);
+    }
+}
+#endif
@@ -0,0 +1,38 @@
+#version 450
+
+// Instanced rocks: the model matrix of each instance is fetched from the
+// object buffer, through the ids of the visible objects written by CullShader.comp
+
+layout(set = 0, binding = 0) uniform globalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+} gubo;
+
+struct ObjectData {
+	mat4 model;
+	uvec4 mesh;
+};
+
+layout(std430, set = 2, binding = 1) readonly buffer Objects {
+	ObjectData objects[];
+};
+
+layout(std430, set = 2, binding = 4) readonly buffer VisibleObjects {
+	uint visibleIds[];
+};
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+
+void main() {
+	mat4 model = objects[visibleIds[gl_InstanceIndex]].model;
+	gl_Position = gubo.proj * gubo.view * model * vec4(pos, 1.0);
+	fragViewDir  = (gubo.view[3]).xyz - (model * vec4(pos,  1.0)).xyz;
+	fragNorm     = (model * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+}